@@ -39,6 +39,7 @@ in
         gperftools
         jemalloc
         fmt
+        tbb
         clang_10
         hyperfine
       ];
@@ -2,52 +2,99 @@
 #include "util.hpp"
 #include <functional>
 
+// a slope is a (right, down) pair; each one keeps its own running column
+struct slope {
+    int right;
+    int down;
+
+    int step { 0 }; // right reduced modulo the map width
+    int col { 0 };
+    long trees { 0 };
+};
+
 int day03(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file.\n");
+        fmt::print("Provide an input file and optionally a list of slopes as right,down pairs.\n");
         return 1;
     }
 
+    std::vector<slope> slopes;
+    for (int i = 2; i < argc; ++i) {
+        auto tokens = split(argv[i], ',');
+        auto right = tokens.size() == 2 ? parse_number<int>(tokens[0]) : std::nullopt;
+        auto down = tokens.size() == 2 ? parse_number<int>(tokens[1]) : std::nullopt;
+        if (!right.has_value() || !down.has_value() || right.value() < 0 || down.value() < 1) {
+            throw std::runtime_error(fmt::format("cannot parse slope from {}\n", argv[i]));
+        }
+        slopes.push_back({ right.value(), down.value() });
+    }
+
+    // the slopes from the puzzle, part 1 is the second one
+    bool const default_slopes = slopes.empty();
+    if (default_slopes) {
+        slopes = { { 1, 1 }, { 3, 1 }, { 5, 1 }, { 7, 1 }, { 1, 2 } };
+    }
+
     std::ifstream in(argv[1]);
     std::string line;
 
-    int nrow = 0;
+    // the map is streamed one row at a time, only the current row is kept in memory as a bitset
+    std::vector<uint64_t> row;
+
     int ncol = 0;
+    int nrow = 0;
 
     while (std::getline(in, line)) {
-        ++nrow;
-        ncol = line.size();
-    }
-
-    using A = Eigen::Array<char, -1, -1>;
-
-    A a(nrow, ncol);
+        if (line.empty()) {
+            continue;
+        }
 
-    in.clear();
-    in.seekg(0);
+        if (ncol == 0) {
+            ncol = line.size();
+            row.resize((ncol + 63) / 64);
+            // reduce the steps once so the columns can advance with a single subtraction
+            for (auto& s : slopes) {
+                s.step = s.right % ncol;
+            }
+        } else if (static_cast<int>(line.size()) != ncol) {
+            throw std::runtime_error(fmt::format("row {} has {} columns, expected {}\n", nrow, line.size(), ncol));
+        }
 
-    int row = 0;
-    while (std::getline(in, line)) {
-        Eigen::Map<Eigen::Array<char, 1, -1>> r(line.data(), line.size());
-        a.row(row++) = r;
-    }
+        for (size_t w = 0; w < row.size(); ++w) {
+            uint64_t bits = 0;
+            auto const* p = line.data() + 64 * w;
+            auto const n = std::min(64, ncol - static_cast<int>(64 * w));
+            for (int i = 0; i < n; ++i) {
+                bits |= static_cast<uint64_t>(p[i] == '#') << i;
+            }
+            row[w] = bits;
+        }
 
-    auto encountered_trees = [&](int right, int down) -> long {
-        int x = 0, y = 0, n = 0;
-        while (x < a.rows()) {
-            n += a(x, y) == '#';
-            x += down;
-            y = (y + right) % a.cols();
+        for (auto& s : slopes) {
+            if (nrow % s.down != 0) {
+                continue;
+            }
+            s.trees += (row[s.col / 64] >> (s.col % 64)) & 1;
+            s.col += s.step;
+            if (s.col >= ncol) {
+                s.col -= ncol;
+            }
         }
-        return n;
-    };
+        ++nrow;
+    }
 
-    std::cout << a << "\n";
+    long p = std::transform_reduce(slopes.begin(), slopes.end(), 1L, std::multiplies {}, [](auto const& s) { return s.trees; });
 
-    long p = encountered_trees(1, 1) * encountered_trees(3, 1) * encountered_trees(5, 1) * encountered_trees(7, 1) * encountered_trees(1, 2);
+    if (default_slopes) {
+        fmt::print("part 1: {}\n", slopes[1].trees);
+        fmt::print("part 2: {}\n", p);
+        return 0;
+    }
 
-    fmt::print("part 1: {}\n", encountered_trees(3, 1));
-    fmt::print("part 2: {}\n", p);
+    for (auto const& s : slopes) {
+        fmt::print("slope {},{}: {}\n", s.right, s.down, s.trees);
+    }
+    fmt::print("product: {}\n", p);
     return 0;
 }
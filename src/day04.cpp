@@ -1,149 +1,296 @@
 #include <cctype>
+#include <chrono>
+#include <cstring>
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
 #include <functional>
 
-int day04(int argc, char** argv)
-{
-    if (argc < 2) {
-        fmt::print("Provide an input file.\n");
-        return 1;
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+
+namespace passport {
+    // the field order gives the bit position in the presence mask
+    enum field : uint8_t { BYR, IYR, EYR, HGT, HCL, ECL, PID, CID, NONE };
+
+    static constexpr uint8_t required = 0x7f; // every field except cid
+
+    // a three-letter tag packed into the low bytes of a 32-bit word
+    static constexpr uint32_t tag(char const* s)
+    {
+        return static_cast<uint32_t>(static_cast<uint8_t>(s[0]))
+            | static_cast<uint32_t>(static_cast<uint8_t>(s[1])) << 8
+            | static_cast<uint32_t>(static_cast<uint8_t>(s[2])) << 16;
+    }
+
+    static constexpr std::array<uint32_t, 8> tags {
+        tag("byr"), tag("iyr"), tag("eyr"), tag("hgt"), tag("hcl"), tag("ecl"), tag("pid"), tag("cid")
+    };
+
+    // multiplicative hash onto 8 slots
+    static constexpr uint32_t slot(uint32_t t, uint32_t m)
+    {
+        return (t * m) >> 29;
     }
 
-    std::string required_fields[] = { "byr", "iyr", "eyr", "hgt", "hcl", "ecl", "pid" };
-
-    std::unordered_map<std::string_view, std::function<bool(std::string_view)>> validation_rules {
-        { 
-            "byr", [](auto const& s) { 
-                auto res = parse_number<int>(s); 
-                if (!res.has_value() || res.value() < 1920 || res.value() > 2002)
-                    return false;
-                return true;
-            } 
-        },
-        {
-            "iyr", [](auto const& s) {
-                auto res = parse_number<int>(s); 
-                if (!res.has_value() || res.value() < 2010 || res.value() > 2020)
-                    return false;
-                return true;
+    // search for a multiplier that sends every tag to a distinct slot, starting from the golden ratio
+    static constexpr uint32_t find_multiplier()
+    {
+        for (uint32_t m = 0x9e3779b1; m > 1; m += 2) {
+            uint32_t used = 0;
+            for (auto t : tags) {
+                used |= 1u << slot(t, m);
             }
-        },
-        {
-            "eyr", [](auto const& s) {
-                auto res = parse_number<int>(s); 
-                if (!res.has_value() || res.value() < 2020 || res.value() > 2030)
-                    return false;
-                return true;
+            if (used == 0xff) {
+                return m;
             }
-        },
-        {
-            "hgt", [](auto const& s) {
-                std::string_view unit(s.data() + s.size() - 2, 2);
-                std::string_view height(s.data(), s.size() - 2);
-                auto res = parse_number<int>(height);
+        }
+        return 0;
+    }
 
-                if (!res.has_value()) {
-                    return false;
-                }
+    static constexpr uint32_t multiplier = find_multiplier();
+    static_assert(multiplier != 0, "no perfect hash for the passport tags");
 
-                auto heightval = res.value();
+    static constexpr std::array<field, 8> slots = []() {
+        std::array<field, 8> s {};
+        for (uint8_t f = BYR; f < NONE; ++f) {
+            s[slot(tags[f], multiplier)] = static_cast<field>(f);
+        }
+        return s;
+    }();
 
-                if (unit == "cm")
-                    return heightval >= 150 && heightval <= 193;
+    static inline field field_of(std::string_view key)
+    {
+        if (key.size() != 3) {
+            return NONE;
+        }
+        auto t = tag(key.data());
+        auto f = slots[slot(t, multiplier)];
+        return tags[f] == t ? f : NONE;
+    }
 
-                if (unit == "in")
-                    return heightval >= 59 && heightval <= 76;
+    // SWAR character classes: each byte of the result has its high bit set if the
+    // corresponding input byte lies in [lo, hi]. input bytes must be 7-bit ascii.
+    static constexpr uint64_t ones = 0x0101010101010101;
+    static constexpr uint64_t high = 0x8080808080808080;
 
-                return false;
-            }
-        },
-        {
-            "hcl", [](auto const& s) {
-                if (s.size() != 7)
-                    return false;
-
-                if (s[0] != '#')
-                    return false;
-
-                return std::all_of(s.begin() + 1, s.end(), [](char c) {
-                    return std::isdigit(c) || (std::islower(c) && std::isalpha(c));
-                        });
-            }
-        },
-        {
-            "ecl", [](auto const& s) {
-                return 
-                    s == "amb" || s == "blu" || s == "brn" || 
-                    s == "gry" || s == "grn" || s == "hzl" || s == "oth";
-            }
-        },
-        {
-            "pid", [](auto const& s) {
-                return s.size() == 9
-                    && std::all_of(s.begin(), s.end(), [](char c) { return std::isdigit(c); });
-            }
-        },
-        {
-            "cid", [](auto const& s) {
-                return true;
-            }
+    static inline uint64_t between(uint64_t x, uint8_t lo, uint8_t hi)
+    {
+        auto above = x + ones * (0x7f - hi);
+        auto at_least = x + ones * (0x80 - lo);
+        return at_least & ~above & high;
+    }
+
+    static inline uint64_t load(std::string_view s, size_t n, char pad)
+    {
+        uint64_t x = ones * static_cast<uint8_t>(pad);
+        std::memcpy(&x, s.data(), n);
+        return x;
+    }
+
+    static inline bool is_ascii(uint64_t x) { return (x & high) == 0; }
+
+    static inline bool all_digits(uint64_t x)
+    {
+        return is_ascii(x) && between(x, '0', '9') == high;
+    }
+
+    static inline bool all_hex(uint64_t x)
+    {
+        return is_ascii(x) && (between(x, '0', '9') | between(x, 'a', 'f')) == high;
+    }
+
+    static inline bool year(std::string_view s, int lo, int hi)
+    {
+        if (s.size() != 4 || !all_digits(load(s, 4, '0'))) {
+            return false;
         }
-    };
+        auto y = parse_number<int>(s).value();
+        return y >= lo && y <= hi;
+    }
 
-    std::ifstream in(argv[1]);
-    std::string line;
-
-    std::vector<std::string_view> fields;
-
-    auto validate_entry = [&](std::string_view entry) {
-        // validate passport entry
-        fields.clear();
-        int pos = 0;
-        while (pos < entry.size()) {
-            if (pos = entry.find(':', pos+1); pos != -1) {
-                auto field = std::string_view(entry.data() + pos - 3, 3);
-                auto pos1 = entry.find(' ', pos+1);
-                if (pos1 == -1) pos1 = entry.size();
-                auto value = std::string_view(entry.data() + pos + 1, pos1 - pos - 1);
-                auto it = validation_rules.find(field);
-
-                if (it != validation_rules.end() && it->second(value))
-                    fields.push_back(field);
-            }
+    static inline bool height(std::string_view s)
+    {
+        if (s.size() < 3) {
+            return false;
         }
-        std::sort(begin(fields), end(fields));
-        return std::all_of(begin(required_fields), end(required_fields), [&](auto const& f) { 
-                return std::binary_search(begin(fields), end(fields), f);
-                });
-    };
+        auto res = parse_number<int>(s.substr(0, s.size() - 2));
+        if (!res.has_value()) {
+            return false;
+        }
+        auto h = res.value();
+        auto unit = s.substr(s.size() - 2);
+        if (unit == "cm") return h >= 150 && h <= 193;
+        if (unit == "in") return h >= 59 && h <= 76;
+        return false;
+    }
 
-    fmt::memory_buffer buf;
-    bool space = false;
-    int valid_entries = 0;
-    while (std::getline(in, line)) {
-        if (line.empty() && buf.size() > 0) {
-            std::string_view entry(buf.data(), buf.size()); 
-            valid_entries += validate_entry(entry); 
-            // encountered an empty line, reset the buffer
-            buf.clear();
-        } 
-        fmt::format_to(buf, "{}", buf.size() > 0 ? " " : ""); 
-        for (auto c : line) {
-            if (std::isspace(c)) {
-                space = true;
+    static inline bool hair(std::string_view s)
+    {
+        return s.size() == 7 && s[0] == '#' && all_hex(load(s.substr(1), 6, '0'));
+    }
+
+    static inline bool eyes(std::string_view s)
+    {
+        if (s.size() != 3) {
+            return false;
+        }
+        switch (tag(s.data())) {
+        case tag("amb"): case tag("blu"): case tag("brn"): case tag("gry"):
+        case tag("grn"): case tag("hzl"): case tag("oth"):
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static inline bool id(std::string_view s)
+    {
+        return s.size() == 9 && all_digits(load(s, 8, '0')) && std::isdigit(s[8]);
+    }
+
+    static inline bool validate(field f, std::string_view value)
+    {
+        switch (f) {
+        case BYR: return year(value, 1920, 2002);
+        case IYR: return year(value, 2010, 2020);
+        case EYR: return year(value, 2020, 2030);
+        case HGT: return height(value);
+        case HCL: return hair(value);
+        case ECL: return eyes(value);
+        case PID: return id(value);
+        case CID: return true;
+        default: return false;
+        }
+    }
+
+    static inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // returns the presence mask and the mask of fields that passed validation. the record
+    // is scanned in place, key:value pairs are separated by any whitespace.
+    static inline std::pair<uint8_t, uint8_t> check(std::string_view record)
+    {
+        uint8_t present = 0, valid = 0;
+        auto const* p = record.data();
+        auto const* end = p + record.size();
+        while (p < end) {
+            while (p < end && is_space(*p)) ++p;
+            auto const* q = p;
+            while (q < end && !is_space(*q)) ++q;
+            std::string_view kv(p, q - p);
+            p = q;
+
+            if (kv.size() < 4 || kv[3] != ':') {
+                continue;
+            }
+            auto f = field_of(kv.substr(0, 3));
+            if (f == NONE) {
                 continue;
             }
-            if (space) {
-                space = false;
-                fmt::format_to(buf, "{}", ' '); 
+            present |= 1u << f;
+            valid |= static_cast<uint8_t>(validate(f, kv.substr(4))) << f;
+        }
+        return { present, valid };
+    }
+
+    // the first newline at or after pos that is followed by a blank line, which may end in "\r\n"
+    static size_t blank_line(std::string_view input, size_t pos)
+    {
+        for (auto nl = input.find('\n', pos); nl != std::string_view::npos; nl = input.find('\n', nl + 1)) {
+            auto next = nl + 1;
+            next += next < input.size() && input[next] == '\r';
+            if (next < input.size() && input[next] == '\n') {
+                return nl;
             }
-            fmt::format_to(buf, "{}", c); 
         }
+        return input.size();
+    }
+
+    // records are separated by blank lines
+    static std::vector<std::string_view> records(std::string_view input)
+    {
+        std::vector<std::string_view> result;
+        size_t pos = 0;
+        while ((pos = input.find_first_not_of("\r\n", pos)) != std::string_view::npos) {
+            auto end = blank_line(input, pos);
+            result.push_back(input.substr(pos, end - pos));
+            pos = end;
+        }
+        return result;
+    }
+} // namespace passport
+
+int day04(int argc, char** argv)
+{
+    if (argc < 2) {
+        fmt::print("Provide an input file and optionally a benchmark batch size (0 skips the batch, the default).\n");
+        return 1;
+    }
+
+    // a useful batch is around 10^7 passports and takes seconds, so it only runs when asked for
+    size_t batch_size = argc > 2 ? parse_number<size_t>(argv[2]).value() : 0;
+
+    std::ifstream in(argv[1], std::ios::binary);
+    std::string input { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+
+    // find the record boundaries up front so that records can be validated in parallel chunks
+    auto entries = passport::records(input);
+
+    using counts = std::pair<int, int>;
+    auto plus = [](counts a, counts b) { return counts { a.first + b.first, a.second + b.second }; };
+
+    auto count_chunk = [&](gsl::span<std::string_view const> chunk) {
+        counts c { 0, 0 };
+        for (auto const& e : chunk) {
+            auto [present, valid] = passport::check(e);
+            c.first += (present & passport::required) == passport::required;
+            c.second += (valid & passport::required) == passport::required;
+        }
+        return c;
+    };
+
+    auto count = [&]() {
+        auto parts = parallel_chunks(entries.size(), [&](size_t begin, size_t end) {
+            return count_chunk({ entries.data() + begin, end - begin });
+        });
+        return std::accumulate(parts.begin(), parts.end(), counts { 0, 0 }, plus);
+    };
+
+    auto [part1, part2] = count();
+    fmt::print("part 1: {}\n", part1);
+    fmt::print("part 2: {}\n", part2);
+
+    // time a second pass so that the thread pool start-up is not included
+    auto t0 = std::chrono::steady_clock::now();
+    ankerl::nanobench::doNotOptimizeAway(count());
+    auto t1 = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration<double>(t1 - t0).count();
+    fmt::print("throughput: {:.1f} MB/s ({} bytes, {} threads)\n", input.size() / seconds / 1e6, input.size(), chunk_count());
+
+    if (entries.empty()) {
+        return 0;
     }
 
-    fmt::print("valid: {}\n", valid_entries);
+    // validate a batch of passports by cycling over the input records
+    auto count_batch = [&](size_t n) {
+        counts c { 0, 0 };
+        for (size_t i = 0; i < n; i += entries.size()) {
+            auto m = std::min(entries.size(), n - i);
+            c = plus(c, count_chunk({ entries.data(), m }));
+        }
+        return c;
+    };
+
+    ankerl::nanobench::Bench b;
+    b.performanceCounters(true).minEpochIterations(10).batch(input.size()).unit("byte");
+    b.run("validate input", [&]() { ankerl::nanobench::doNotOptimizeAway(count()); });
+    if (batch_size > 0) {
+        b.minEpochIterations(1).batch(batch_size).unit("passport");
+        b.run(fmt::format("validate {} passports", batch_size), [&]() { ankerl::nanobench::doNotOptimizeAway(count_batch(batch_size)); });
+    }
 
     return 0;
 }
@@ -1,8 +1,33 @@
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
+#include <cstring>
 #include <functional>
-#include <bitset>
+
+namespace boarding {
+    static constexpr uint64_t ones = 0x0101010101010101;
+
+    // moves bit 0 of every byte into one byte, with the first byte ending up in the most significant bit
+    static constexpr uint64_t gather = 0x8040201008040201;
+
+    // 'B' and 'R' have bit 2 clear while 'F' and 'L' have it set, so each code character
+    // maps to its bit with a shift and a mask. eight characters are decoded per step.
+    static inline uint64_t decode(std::string_view code)
+    {
+        uint64_t id = 0;
+        size_t i = 0;
+        for (; i + 8 <= code.size(); i += 8) {
+            uint64_t x;
+            std::memcpy(&x, code.data() + i, 8);
+            auto bits = (~x >> 2) & ones;
+            id = (id << 8) | ((bits * gather) >> 56);
+        }
+        for (; i < code.size(); ++i) {
+            id = (id << 1) | ((~code[i] >> 2) & 1);
+        }
+        return id;
+    }
+} // namespace boarding
 
 int day05(int argc, char** argv)
 {
@@ -14,34 +39,56 @@ int day05(int argc, char** argv)
     std::ifstream in(argv[1]);
     std::string line;
 
-    int maxID = 0;
-
-    std::vector<int> ids;
+    // one bit per seat, the code length determines the size of the plane
+    std::vector<uint64_t> seats;
+    size_t length = 0;
 
     while(std::getline(in, line)) {
-        std::bitset<10> bits;
-        size_t i = 10;
-        for (auto c : line) {
-            bits[--i] = (c == 'R' || c == 'B');
+        if (line.empty()) {
+            continue;
+        }
+        if (length == 0) {
+            length = line.size();
+            if (length > 32) {
+                throw std::runtime_error(fmt::format("boarding pass codes of length {} are not supported\n", length));
+            }
+            seats.resize(((uint64_t{1} << length) + 63) / 64, 0);
+        } else if (line.size() != length) {
+            throw std::runtime_error(fmt::format("boarding pass {} does not have length {}\n", line, length));
         }
-        int id = bits.to_ulong();
-        maxID = std::max(id, maxID);
-        ids.push_back(id);
+        auto id = boarding::decode(line);
+        seats[id / 64] |= uint64_t{1} << (id % 64);
     }
 
+    // the highest occupied seat is found by scanning the words from the top
+    auto last = std::find_if(seats.rbegin(), seats.rend(), [](auto w) { return w != 0; });
+    if (last == seats.rend()) {
+        fmt::print("no boarding passes\n");
+        return 0;
+    }
+    auto hi = std::distance(last, seats.rend()) - 1;
+    auto maxID = hi * 64 + 63 - __builtin_clzll(seats[hi]);
     fmt::print("part 1: {}\n", maxID);
 
-    std::sort(ids.begin(), ids.end());
-
-    int seatID;
-    for (size_t i = 1; i < ids.size(); ++i) {
-        if (ids[i] - ids[i-1] == 2) {
-            seatID = ids[i] - 1;
+    // our seat is free while the seats on both sides of it are occupied
+    std::optional<uint64_t> seatID;
+    for (size_t k = 0; k < seats.size(); ++k) {
+        auto w = seats[k];
+        auto prev = k > 0 ? seats[k - 1] : 0;
+        auto next = k + 1 < seats.size() ? seats[k + 1] : 0;
+        auto left = (w << 1) | (prev >> 63);
+        auto right = (w >> 1) | (next << 63);
+        if (auto candidates = ~w & left & right; candidates != 0) {
+            seatID = k * 64 + __builtin_ctzll(candidates);
             break;
         }
     }
 
-    fmt::print("part 2: {}\n", seatID);
+    if (seatID.has_value()) {
+        fmt::print("part 2: {}\n", seatID.value());
+    } else {
+        fmt::print("part 2 no solution\n");
+    }
 
     return 0;
 }
@@ -1,44 +1,92 @@
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
+#include <execution>
 #include <functional>
-#include <bitset>
+
+namespace customs {
+    // one bit per question, the loop below is a shift + or-reduce that the compiler vectorizes
+    static inline uint32_t line_mask(char const* p, char const* q)
+    {
+        uint32_t mask = 0;
+        for (; p < q; ++p) {
+            mask |= 1u << ((*p - 'a') & 31);
+        }
+        return mask & ((1u << 26) - 1);
+    }
+
+    // returns the sums of the union and intersection counts over the groups in [p, q)
+    static std::pair<int, int> count(char const* p, char const* q)
+    {
+        int count1 = 0, count2 = 0;
+        uint32_t any = 0, all = ~0u;
+        bool group = false;
+
+        auto close = [&]() {
+            if (group) {
+                count1 += __builtin_popcount(any);
+                count2 += __builtin_popcount(all);
+            }
+            any = 0;
+            all = ~0u;
+            group = false;
+        };
+
+        while (p < q) {
+            auto eol = std::find(p, q, '\n');
+            auto end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+            if (end == p) {
+                close();
+            } else {
+                auto m = line_mask(p, end);
+                any |= m;
+                all &= m;
+                group = true;
+            }
+            p = eol == q ? q : eol + 1;
+        }
+        // the last group does not need a trailing blank line
+        close();
+        return { count1, count2 };
+    }
+} // namespace customs
 
 int day06(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file.\n");
+        fmt::print("Provide an input file and optionally the number of chunks.\n");
         return 1;
     }
 
-    std::ifstream in(argv[1]);
-    std::string line;
-
-    std::bitset<26> bits; bits.reset();
-    std::bitset<26> all; all.set();
+    std::ifstream in(argv[1], std::ios::binary);
+    std::string input { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
 
-    int count1 = 0, count2 = 0;
-
-    while(std::getline(in, line)) {
-        if (line.empty()) {
-            count1 += bits.count();
-            bits.reset();
-
-            count2 += all.count();
-            all.set();
+    size_t nchunks = argc > 2 ? parse_number<size_t>(argv[2]).value() : chunk_count();
+    if (nchunks < 1) {
+        fmt::print("The number of chunks must be at least 1.\n");
+        return 1;
+    }
 
-            continue;
+    // split the input into roughly equal chunks, moving each split point forward to a blank line
+    std::vector<std::pair<char const*, char const*>> chunks;
+    size_t begin = 0;
+    for (size_t i = 1; i <= nchunks && begin < input.size(); ++i) {
+        auto end = i == nchunks ? input.size() : std::max(begin, input.size() * i / nchunks);
+        if (end < input.size()) {
+            end = input.find("\n\n", end);
+            end = end == std::string::npos ? input.size() : end + 1;
         }
-        std::bitset<26> tmp;
-        for (char c : line) {
-            bits.set(c - 'a', true);
-            tmp.set(c - 'a', true);
-        }
-        all &= tmp;
+        chunks.emplace_back(input.data() + begin, input.data() + end);
+        begin = end;
     }
+
+    using counts = std::pair<int, int>;
+    auto [count1, count2] = std::transform_reduce(std::execution::par, chunks.begin(), chunks.end(), counts { 0, 0 },
+        [](counts a, counts b) { return counts { a.first + b.first, a.second + b.second }; },
+        [](auto c) { return customs::count(c.first, c.second); });
+
     fmt::print("part 1: {}\n", count1);
     fmt::print("part 2: {}\n", count2);
 
     return 0;
 }
-
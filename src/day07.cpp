@@ -1,9 +1,332 @@
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
+#include "robin_hood.h"
+#include <execution>
 #include <functional>
 #include <bitset>
 
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+
+// edges in compressed sparse row form, the edges of node i are [offset[i], offset[i+1]).
+// rows that are edited after construction are moved out of the arrays into their own vectors.
+struct csr {
+    std::vector<int> offset;
+    std::vector<int> target;
+    std::vector<int> weight;
+
+    struct row {
+        std::vector<int> target;
+        std::vector<int> weight;
+    };
+    std::vector<int> moved; // index into rows, or -1 if the row still lives in the arrays
+    std::vector<row> rows;
+
+    csr() = default;
+
+    // edges are (source, target, weight) triples
+    csr(size_t n, std::vector<std::tuple<int, int, int>> const& edges)
+        : offset(n + 1, 0), target(edges.size()), weight(edges.size()), moved(n, -1)
+    {
+        for (auto const& e : edges) {
+            ++offset[std::get<0>(e) + 1];
+        }
+        std::partial_sum(offset.begin(), offset.end(), offset.begin());
+        auto pos = offset;
+        for (auto [s, t, w] : edges) {
+            auto i = pos[s]++;
+            target[i] = t;
+            weight[i] = w;
+        }
+    }
+
+    size_t size() const { return moved.size(); }
+
+    // new nodes start out with an empty edited row
+    void resize(size_t n)
+    {
+        while (moved.size() < n) {
+            moved.push_back(rows.size());
+            rows.emplace_back();
+        }
+    }
+
+    size_t degree(int i) const { return targets(i).size(); }
+
+    gsl::span<int const> targets(int i) const
+    {
+        if (moved[i] >= 0) return rows[moved[i]].target;
+        return { target.data() + offset[i], static_cast<size_t>(offset[i + 1] - offset[i]) };
+    }
+
+    gsl::span<int const> weights(int i) const
+    {
+        if (moved[i] >= 0) return rows[moved[i]].weight;
+        return { weight.data() + offset[i], static_cast<size_t>(offset[i + 1] - offset[i]) };
+    }
+
+    // sets the weight of edge s -> t, a weight of zero removes it. returns the previous weight.
+    int set(int s, int t, int w)
+    {
+        if (moved[s] < 0) {
+            moved[s] = rows.size();
+            rows.push_back({ { target.begin() + offset[s], target.begin() + offset[s + 1] },
+                             { weight.begin() + offset[s], weight.begin() + offset[s + 1] } });
+        }
+        auto& r = rows[moved[s]];
+        auto it = std::find(r.target.begin(), r.target.end(), t);
+        if (it == r.target.end()) {
+            if (w != 0) {
+                r.target.push_back(t);
+                r.weight.push_back(w);
+            }
+            return 0;
+        }
+        auto i = it - r.target.begin();
+        auto old = r.weight[i];
+        if (w != 0) {
+            r.weight[i] = w;
+        } else {
+            r.target.erase(it);
+            r.weight.erase(r.weight.begin() + i);
+        }
+        return old;
+    }
+};
+
+struct bag_graph {
+    // bag counts grow exponentially with the nesting depth
+    using count_t = unsigned __int128;
+
+    robin_hood::unordered_map<std::string, int> ids;
+    std::vector<std::string> names;
+
+    csr contains;  // container -> content, weighted by quantity
+    csr contained; // content -> container
+
+    std::vector<int> order; // topological order at load time, contents before their containers
+
+    // memoized results. totals and ancestor sets are recomputed lazily after an edit:
+    // a stale total implies stale totals for all ancestors, a stale ancestor set
+    // implies stale ancestor sets for all descendants.
+    std::vector<count_t> totals;                  // number of bags inside each bag
+    std::vector<bool> stale_totals;
+    std::vector<std::vector<uint64_t>> ancestors; // bitset of the bags that eventually contain each bag
+    std::vector<size_t> containers;               // popcount of the ancestor set
+    std::vector<bool> stale_ancestors;
+
+    int intern(std::string const& name)
+    {
+        auto [it, ok] = ids.insert({ name, static_cast<int>(names.size()) });
+        if (ok) {
+            names.push_back(name);
+        }
+        return it->second;
+    }
+
+    std::optional<int> find(std::string const& name) const
+    {
+        if (auto it = ids.find(name); it != ids.end()) {
+            return { it->second };
+        }
+        return std::nullopt;
+    }
+
+    // edges are (container, content, quantity) triples over interned ids
+    void build(std::vector<std::tuple<int, int, int>> const& edges)
+    {
+        auto n = names.size();
+        std::vector<std::tuple<int, int, int>> reversed;
+        reversed.reserve(edges.size());
+        for (auto [s, t, w] : edges) {
+            reversed.emplace_back(t, s, w);
+        }
+        contains = csr(n, edges);
+        contained = csr(n, reversed);
+
+        // kahn's algorithm, starting from the bags that contain nothing
+        std::vector<size_t> pending(n);
+        order.clear();
+        order.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            pending[i] = contains.degree(i);
+            if (pending[i] == 0) {
+                order.push_back(i);
+            }
+        }
+        for (size_t k = 0; k < order.size(); ++k) {
+            for (auto u : contained.targets(order[k])) {
+                if (--pending[u] == 0) {
+                    order.push_back(u);
+                }
+            }
+        }
+        if (order.size() != n) {
+            throw std::runtime_error(fmt::format("the bag rules contain a cycle\n"));
+        }
+
+        totals.assign(n, 0);
+        stale_totals.assign(n, true);
+        ancestors.assign(n, {});
+        containers.assign(n, 0);
+        stale_ancestors.assign(n, true);
+    }
+
+    // computes every total and ancestor set, afterwards all queries are lookups
+    void solve()
+    {
+        for (auto v : order) {
+            refresh_total(v);
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            refresh_ancestors(*it);
+        }
+    }
+
+    // queries refresh stale entries first. concurrent queries are safe once the graph has been solved.
+    size_t count_containers(int v)
+    {
+        if (stale_ancestors[v]) refresh(v, contained, stale_ancestors, [&](int u) { compute_ancestors(u); });
+        return containers[v];
+    }
+
+    count_t count_contents(int v)
+    {
+        if (stale_totals[v]) refresh(v, contains, stale_totals, [&](int u) { compute_total(u); });
+        return totals[v];
+    }
+
+    // sets the quantity of content inside container, zero removes the rule
+    void set_rule(int container, int content, int qty)
+    {
+        auto n = names.size();
+        if (contains.size() < n) {
+            contains.resize(n);
+            contained.resize(n);
+            totals.resize(n, 0);
+            stale_totals.resize(n, true);
+            ancestors.resize(n);
+            containers.resize(n, 0);
+            stale_ancestors.resize(n, true);
+        }
+        if (qty != 0 && (container == content || reaches(content, container))) {
+            throw std::runtime_error(fmt::format("{} bags cannot contain {} bags without a cycle\n", names[container], names[content]));
+        }
+
+        auto old = contains.set(container, content, qty);
+        contained.set(content, container, qty);
+        if (old == qty) {
+            return;
+        }
+        // a different quantity changes the totals of the container and everything above it
+        invalidate(container, contained, stale_totals);
+        // adding or removing the edge changes the ancestor sets of the content and everything below it
+        if (old == 0 || qty == 0) {
+            invalidate(content, contains, stale_ancestors);
+        }
+    }
+
+private:
+    // marks v and everything reachable from v along edges as stale, stopping at entries that are already stale
+    void invalidate(int v, csr const& edges, std::vector<bool>& stale)
+    {
+        std::vector<int> stack { v };
+        while (!stack.empty()) {
+            auto u = stack.back();
+            stack.pop_back();
+            if (stale[u]) continue;
+            stale[u] = true;
+            for (auto w : edges.targets(u)) {
+                if (!stale[w]) stack.push_back(w);
+            }
+        }
+    }
+
+    // recomputes v after every stale dependency along edges has been recomputed, without recursion
+    template <typename F>
+    void refresh(int v, csr const& deps, std::vector<bool>& stale, F&& compute)
+    {
+        std::vector<std::pair<int, bool>> stack { { v, false } };
+        while (!stack.empty()) {
+            auto [u, expanded] = stack.back();
+            if (!stale[u]) {
+                stack.pop_back();
+                continue;
+            }
+            if (expanded) {
+                compute(u);
+                stale[u] = false;
+                stack.pop_back();
+                continue;
+            }
+            stack.back().second = true;
+            for (auto w : deps.targets(u)) {
+                if (stale[w]) stack.emplace_back(w, false);
+            }
+        }
+    }
+
+    void refresh_total(int v) { refresh(v, contains, stale_totals, [&](int u) { compute_total(u); }); }
+    void refresh_ancestors(int v) { refresh(v, contained, stale_ancestors, [&](int u) { compute_ancestors(u); }); }
+
+    void compute_total(int v)
+    {
+        count_t total = 0;
+        auto targets = contains.targets(v);
+        auto weights = contains.weights(v);
+        for (size_t i = 0; i < targets.size(); ++i) {
+            count_t c;
+            if (__builtin_add_overflow(totals[targets[i]], count_t { 1 }, &c)
+                || __builtin_mul_overflow(c, static_cast<count_t>(weights[i]), &c)
+                || __builtin_add_overflow(total, c, &total)) {
+                throw std::overflow_error(fmt::format("bag count overflow in {}\n", names[v]));
+            }
+        }
+        totals[v] = total;
+    }
+
+    void compute_ancestors(int v)
+    {
+        auto& row = ancestors[v];
+        row.assign((names.size() + 63) / 64, 0);
+        for (auto u : contained.targets(v)) {
+            auto const& up = ancestors[u];
+            for (size_t w = 0; w < up.size(); ++w) {
+                row[w] |= up[w];
+            }
+            row[u / 64] |= uint64_t { 1 } << (u % 64);
+        }
+        containers[v] = std::transform_reduce(row.begin(), row.end(), size_t { 0 }, std::plus {}, [](auto w) { return __builtin_popcountll(w); });
+    }
+
+    // true if target is a content of source, directly or indirectly
+    bool reaches(int source, int target) const
+    {
+        std::vector<bool> seen(names.size(), false);
+        std::vector<int> stack { source };
+        while (!stack.empty()) {
+            auto u = stack.back();
+            stack.pop_back();
+            if (u == target) return true;
+            for (auto w : contains.targets(u)) {
+                if (!seen[w]) {
+                    seen[w] = true;
+                    stack.push_back(w);
+                }
+            }
+        }
+        return false;
+    }
+};
+
+struct bag_query {
+    std::string color;
+    std::optional<int> id;
+    size_t containers { 0 };
+    bag_graph::count_t contents { 0 };
+};
+
 int day07(int argc, char** argv)
 {
     if (argc < 2) {
@@ -14,15 +337,14 @@ int day07(int argc, char** argv)
     std::ifstream in(argv[1]);
     std::string line;
 
-    using item = std::tuple<int, std::string>;
-    std::unordered_map<std::string, std::vector<item>> contains;
-    std::unordered_map<std::string, std::vector<std::string>> contained;
+    bag_graph g;
+    std::vector<std::tuple<int, int, int>> edges;
 
     while(std::getline(in, line)) {
         if (line.empty()) continue;
         auto tokens = split(line, ' ');
 
-        auto key = tokens[0] + tokens[1];
+        auto key = g.intern(tokens[0] + " " + tokens[1]);
 
         if (tokens[4] == "no") {
             continue;
@@ -35,37 +357,93 @@ int day07(int argc, char** argv)
                 std::abort();
             }
 
-            auto s = tokens[i+1] + tokens[i+2]; 
-            contains[key].emplace_back(qty.value(), s);
-            contained[s].push_back(key);
+            auto s = g.intern(tokens[i+1] + " " + tokens[i+2]);
+            edges.emplace_back(key, s, qty.value());
         }
     }
 
-    std::unordered_set<std::string> counted;
-    auto get_count = [&](std::string const& color, auto&& rec) {
-        if (auto [it, ok] = counted.insert(color); ! ok) {
-            return;
+    g.build(edges);
+    g.solve();
+
+    // queries are read one color per line, by default only shiny gold is queried
+    std::vector<bag_query> queries;
+    if (argc > 2) {
+        std::ifstream qin(argv[2]);
+        while (std::getline(qin, line)) {
+            if (line.empty()) continue;
+            queries.push_back(bag_query { line, std::nullopt, 0, 0 });
+        }
+    } else {
+        queries.push_back(bag_query { "shiny gold", std::nullopt, 0, 0 });
+    }
+
+    std::for_each(std::execution::par, queries.begin(), queries.end(), [&](auto& q) {
+        q.id = g.find(q.color);
+        if (q.id.has_value()) {
+            q.containers = g.count_containers(q.id.value());
+            q.contents = g.count_contents(q.id.value());
         }
-        if (auto it = contained.find(color); it != contained.end()) {
-            for (auto& s : it->second) {
-                rec(s, rec);
+    });
+
+    if (argc < 3) {
+        auto const& q = queries.front();
+        if (!q.id.has_value()) {
+            fmt::print("no rule mentions shiny gold bags\n");
+            return 1;
+        }
+        fmt::print("part 1: {}\n", q.containers);
+        fmt::print("part 2: {}\n", q.contents);
+    } else {
+        for (auto const& q : queries) {
+            if (q.id.has_value()) {
+                fmt::print("{}: contained by {}, contains {}\n", q.color, q.containers, q.contents);
+            } else {
+                fmt::print("{}: unknown color\n", q.color);
             }
         }
+    }
+
+    // benchmark single rule edits on a generated rule set. bag k sits inside bags (k-1)/2 and (k-1)/3,
+    // which keeps the rules acyclic and the nesting shallow.
+    constexpr int ncolors = 100'000;
+    bag_graph h;
+    std::vector<std::tuple<int, int, int>> generated;
+    std::mt19937 rng(1234);
+    for (int k = 0; k < ncolors; ++k) {
+        h.intern(fmt::format("color {}", k));
+    }
+    for (int k = 1; k < ncolors; ++k) {
+        generated.emplace_back((k - 1) / 2, k, 1 + rng() % 3);
+        if ((k - 1) / 3 != (k - 1) / 2) {
+            generated.emplace_back((k - 1) / 3, k, 1 + rng() % 3);
+        }
+    }
+    h.build(generated);
+
+    int leaf = ncolors - 1;
+    fmt::print("generated: {} colors, color 0 contains {}, color {} is contained by {}\n", ncolors, h.count_contents(0), leaf, h.count_containers(leaf));
+
+    // edits touch the lower half of the graph, either reweighting a rule or toggling an extra one
+    std::uniform_int_distribution<int> pick(ncolors / 2, ncolors - 1);
+    auto edit = [&]() {
+        auto k = pick(rng);
+        if (rng() % 2) {
+            h.set_rule((k - 1) / 2, k, 1 + rng() % 3);
+        } else {
+            auto extra = (k - 1) / 4;
+            auto present = std::find(h.contains.targets(extra).begin(), h.contains.targets(extra).end(), k) != h.contains.targets(extra).end();
+            h.set_rule(extra, k, present ? 0 : 1);
+        }
     };
-    get_count("shinygold", get_count);
-    fmt::print("part 1: {}\n", counted.size()-1);
-
-    auto get_content_count = [&](std::string const& color, auto&& rec) {
-        int c = 1;
-        if (auto it = contains.find(color); it != contains.end()) {
-            c += std::transform_reduce(begin(it->second), end(it->second), 0, std::plus{}, [&](auto const& a) { 
-                auto [q1, s1] = a;
-                return q1 * rec(s1, rec);
-            });
-        } 
-        return c;
-    };
-    fmt::print("part 2: {}\n", get_content_count("shinygold", get_content_count) - 1);
+
+    ankerl::nanobench::Bench b;
+    b.performanceCounters(true).minEpochIterations(1000);
+    b.run("single rule edit", edit);
+    b.run("single rule edit + queries", [&]() {
+        edit();
+        ankerl::nanobench::doNotOptimizeAway(h.count_contents(0));
+        ankerl::nanobench::doNotOptimizeAway(h.count_containers(leaf));
+    });
 
     return 0;
 }
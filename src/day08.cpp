@@ -3,30 +3,61 @@
 #include "util.hpp"
 #include <functional>
 #include <bitset>
+#include <chrono>
+#include <execution>
+#include <random>
 
 #define ANKERL_NANOBENCH_IMPLEMENT
 #include "nanobench.h"
 
 enum class opcode : int { ACC, JMP, NOP };
-std::string names[] { "acc", "jmp", "nop" };
+
+// effect of an instruction on the accumulator and on the instruction pointer (the index of the
+// entry is its opcode value). only the block compiler goes through this table; the interpreters and
+// the repair engine are written against acc/jmp/nop and reject any other opcode, so a new entry
+// has to be handled there as well.
+struct opcode_info {
+    std::string_view name;
+    int64_t (*acc)(int val);  // accumulator delta
+    int64_t (*next)(int val); // instruction pointer delta
+};
+
+static std::vector<opcode_info> const opcode_table {
+    { "acc", [](int v) { return int64_t { v }; }, [](int) { return int64_t { 1 }; } },
+    { "jmp", [](int) { return int64_t { 0 }; }, [](int v) { return int64_t { v }; } },
+    { "nop", [](int) { return int64_t { 0 }; }, [](int) { return int64_t { 1 }; } },
+};
+
+static std::string_view names(opcode op) { return opcode_table[static_cast<int>(op)].name; }
 
 struct instruction {
     opcode op;
     int val;
 
     friend std::ostream& operator<<(std::ostream& os, instruction in) {
-        os << names[static_cast<int>(in.op)] << "\t" << in.val;
+        os << names(in.op) << "\t" << in.val;
         return os;
     }
 };
 
 opcode str_to_op(std::string const& s) {
-    if (s == "acc") return opcode::ACC;
-    if (s == "jmp") return opcode::JMP;
-    if (s == "nop") return opcode::NOP;
+    for (size_t i = 0; i < opcode_table.size(); ++i) {
+        if (opcode_table[i].name == s) return static_cast<opcode>(i);
+    }
     throw std::runtime_error(fmt::format("unknown op {}\n", s));
 }
 
+// opcodes understood by the hard-coded interpreters
+static bool is_basic(opcode op) { return op == opcode::ACC || op == opcode::JMP || op == opcode::NOP; }
+
+static void expect_basic(gsl::span<instruction const> code)
+{
+    auto it = std::find_if(code.begin(), code.end(), [](auto in) { return !is_basic(in.op); });
+    if (it != code.end()) {
+        throw std::runtime_error(fmt::format("unsupported op {} at {}\n", names(it->op), it - code.begin()));
+    }
+}
+
 struct vm {
     vm(gsl::span<instruction> _code) : A{0}, P{0}, code(_code) {}
     vm(vm const& other) : A(other.A), P(other.P), code(other.code) {}
@@ -45,9 +76,10 @@ struct vm {
             case opcode::JMP:
                 P += in.val - 1; // cancel the above increment
                 break;
-            default:
-                // do nothing
+            case opcode::NOP:
                 break;
+            default:
+                throw std::runtime_error(fmt::format("unsupported op {}\n", names(in.op)));
         };
 
         return true;
@@ -78,20 +110,420 @@ struct vm {
     gsl::span<instruction> code;
 };
 
+// threaded interpreter over a pre-decoded copy of the program. decoded[i] corresponds to code[i],
+// followed by two sentinels for normal termination and for jumps before the start. straight-line
+// runs of acc/nop that are not jump targets are fused into one superinstruction, and jumps to jumps
+// are resolved to the final target of the chain. the records are kept at 8 bytes so the dispatch
+// goes through a label table indexed by the opcode rather than a label address per instruction.
+struct threaded_vm {
+    enum op_t : uint8_t { ACC, RUN, NOP, JMP, LOOP, HALT, FAULT };
+
+    struct decoded {
+        int32_t val;  // accumulator delta for ACC/RUN, absolute target for JMP
+        uint16_t len; // number of original instructions covered
+        uint8_t op;
+        uint8_t mark; // equal to the epoch of the current run if the instruction was visited
+    };
+
+    explicit threaded_vm(gsl::span<instruction const> program)
+    {
+        static constexpr size_t max_len = std::numeric_limits<uint16_t>::max();
+        expect_basic(program);
+
+        auto const n = static_cast<long>(program.size());
+        auto clamp = [&](long t) -> int32_t { return t < 0 ? n + 1 : std::min(t, n); };
+
+        std::vector<bool> leader(n + 1, false);
+        if (n > 0) leader[0] = true;
+        for (long i = 0; i < n; ++i) {
+            if (program[i].op == opcode::JMP) {
+                if (auto t = i + program[i].val; t >= 0 && t < n) leader[t] = true;
+            }
+        }
+
+        code.resize(n + 2);
+        code[n] = { 0, 0, HALT, 0 };
+        code[n + 1] = { 0, 0, FAULT, 0 };
+
+        // straight-line runs, right to left so that each entry extends the one after it
+        for (long i = n - 1; i >= 0; --i) {
+            auto in = program[i];
+            if (in.op == opcode::JMP) {
+                code[i] = { clamp(i + in.val), 1, JMP, 0 };
+                continue;
+            }
+            int32_t delta = in.op == opcode::ACC ? in.val : 0;
+            auto const& nx = code[i + 1];
+            if (i + 1 < n && !leader[i + 1] && (nx.op == ACC || nx.op == RUN || nx.op == NOP) && nx.len < max_len) {
+                code[i] = { delta + nx.val, static_cast<uint16_t>(nx.len + 1), RUN, 0 };
+            } else {
+                code[i] = { delta, 1, in.op == opcode::ACC ? ACC : NOP, 0 };
+            }
+        }
+
+        // jump chains, each chain is followed once and every jump on it is pointed at its end
+        std::vector<uint8_t> state(n, 0); // 0 - unresolved, 1 - on the current chain, 2 - resolved
+        std::vector<long> chain;
+        for (long i = 0; i < n; ++i) {
+            if (code[i].op != JMP || state[i] != 0) continue;
+            chain.clear();
+            long t = i;
+            while (t < n && code[t].op == JMP && state[t] == 0) {
+                state[t] = 1;
+                chain.push_back(t);
+                t = code[t].val;
+            }
+            // the chain ends at a jump that loops back onto the chain itself
+            bool loop = t < n && state[t] == 1;
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                auto& d = code[*it];
+                state[*it] = 2;
+                if (loop) {
+                    d.op = LOOP;
+                    continue;
+                }
+                auto const& target = code[d.val];
+                if (d.val < n && target.op == JMP && d.len + target.len <= max_len) {
+                    d.len += target.len;
+                    d.val = target.val;
+                } else if (d.val < n && target.op == LOOP) {
+                    d.op = LOOP;
+                }
+            }
+        }
+    }
+
+    // a new epoch forgets all visited marks, they only have to be cleared when the epoch wraps
+    void reset()
+    {
+        A = 0;
+        P = 0;
+        steps = 0;
+        if (++epoch == 0) {
+            for (auto& d : code) d.mark = 0;
+            epoch = 1;
+        }
+    }
+
+    // runs until the program terminates (true) or an instruction is about to run a second time (false)
+    bool run()
+    {
+        auto* const base = code.data();
+        auto p = base + P;
+        int64_t a = A;
+        uint64_t s = steps;
+        uint8_t const e = epoch;
+        bool halted = false;
+
+#if defined(__GNUC__) || defined(__clang__)
+        static void* const labels[] = { &&do_acc, &&do_run, &&do_nop, &&do_jmp, &&do_loop, &&do_halt, &&do_fault };
+
+#define NEXT()                     \
+    if (p->mark == e) goto do_loop; \
+    p->mark = e;                   \
+    goto *labels[p->op]
+
+        NEXT();
+    do_acc:
+        a += p->val; s += 1; ++p;
+        NEXT();
+    do_run:
+        a += p->val; s += p->len; p += p->len;
+        NEXT();
+    do_nop:
+        s += 1; ++p;
+        NEXT();
+    do_jmp:
+        s += p->len; p = base + p->val;
+        NEXT();
+#undef NEXT
+    do_halt:
+        halted = true;
+        goto done;
+    do_fault:
+        throw std::runtime_error(fmt::format("jump before the start of the program\n"));
+    do_loop:
+    done:
+#else
+        // portable fallback, a switch dispatch loop over the same decoded stream
+        while (true) {
+            if (p->op == HALT) { halted = true; break; }
+            if (p->op == FAULT) throw std::runtime_error(fmt::format("jump before the start of the program\n"));
+            if (p->op == LOOP || p->mark == e) break;
+            p->mark = e;
+            switch (p->op) {
+            case ACC: a += p->val; s += 1; ++p; break;
+            case RUN: a += p->val; s += p->len; p += p->len; break;
+            case NOP: s += 1; ++p; break;
+            case JMP: s += p->len; p = base + p->val; break;
+            default: break;
+            }
+        }
+#endif
+        A = a;
+        P = p - base;
+        steps = s;
+        return halted;
+    }
+
+    std::vector<decoded> code;
+    uint8_t epoch { 1 };
+
+    // registers
+    int64_t A { 0 };
+    size_t P { 0 };
+
+    uint64_t steps { 0 }; // original instructions executed
+};
+
+// the program compiled into basic blocks. since no instruction branches on a condition, every block
+// reduces to an accumulator delta and a single successor, and the block graph is a functional graph.
+// every jump target starts a block, so the first repeated instruction is always the first
+// instruction of the first repeated block.
+struct block_program {
+    static constexpr int HALT = -1;  // jumps past the end of the program
+    static constexpr int FAULT = -2; // jumps before the start of the program
+
+    struct block {
+        int64_t acc;    // accumulator delta over the block
+        int next;       // successor block, HALT or FAULT
+        uint32_t start; // first instruction
+        uint32_t len;   // number of instructions
+    };
+
+    explicit block_program(gsl::span<instruction const> code)
+    {
+        auto const n = static_cast<int64_t>(code.size());
+        auto target = [&](int64_t i) { return i + opcode_table[static_cast<int>(code[i].op)].next(code[i].val); };
+
+        std::vector<int> leader(n + 1, 0);
+        if (n > 0) leader[0] = 1;
+        for (int64_t i = 0; i < n; ++i) {
+            if (auto t = target(i); t != i + 1) {
+                if (t >= 0 && t < n) leader[t] = 1;
+                leader[i + 1] = 1;
+            }
+        }
+
+        block_of.assign(n, -1);
+        for (int64_t i = 0; i < n;) {
+            block b { 0, 0, static_cast<uint32_t>(i), 0 };
+            auto j = i;
+            do {
+                b.acc += opcode_table[static_cast<int>(code[j].op)].acc(code[j].val);
+                ++j;
+            } while (j < n && !leader[j] && target(j - 1) == j);
+            b.len = j - i;
+            block_of[i] = blocks.size();
+            blocks.push_back(b);
+            i = j;
+        }
+        for (auto& b : blocks) {
+            auto t = target(b.start + b.len - 1);
+            b.next = t < 0 ? FAULT : t >= n ? HALT : block_of[t];
+        }
+    }
+
+    struct result {
+        bool terminated;
+        int64_t acc;         // accumulator at termination, or before the first repeated instruction
+        uint64_t steps;      // instructions executed
+        int loop_entry;      // first repeated block
+        uint64_t loop_len;   // instructions per iteration of the loop
+        int64_t loop_acc;    // accumulator delta per iteration of the loop
+    };
+
+    // walks the block graph from the first block until it halts or a block repeats
+    result run() const
+    {
+        result r { false, 0, 0, -1, 0, 0 };
+        if (blocks.empty()) {
+            r.terminated = true;
+            return r;
+        }
+        std::vector<uint64_t> seen(blocks.size(), 0); // steps before entering the block, plus one
+        std::vector<int64_t> acc_at(blocks.size(), 0);
+        int b = 0;
+        while (b >= 0 && !seen[b]) {
+            seen[b] = r.steps + 1;
+            acc_at[b] = r.acc;
+            r.acc += blocks[b].acc;
+            r.steps += blocks[b].len;
+            b = blocks[b].next;
+        }
+        if (b == FAULT) {
+            throw std::runtime_error(fmt::format("jump before the start of the program\n"));
+        }
+        r.terminated = b == HALT;
+        if (!r.terminated) {
+            r.loop_entry = b;
+            r.loop_len = r.steps - (seen[b] - 1);
+            r.loop_acc = r.acc - acc_at[b];
+        }
+        return r;
+    }
+
+    std::vector<block> blocks;
+    std::vector<int> block_of; // block index for the first instruction of each block, -1 elsewhere
+};
+
+// the repair engine finds the instructions that reach normal termination by a breadth-first
+// search from the end over the reverse edges, then walks the original execution path once and
+// patches the first jmp/nop whose alternate successor is in that set. the buffers are reused
+// between calls.
+struct repair_engine {
+    std::vector<int> offset, source, reaches_end, queue, seen;
+
+    // returns the index of the patched instruction and the accumulator after normal termination,
+    // or nothing if the program already terminates or no single patch makes it terminate
+    std::optional<std::pair<long, int>> operator()(gsl::span<instruction const> code)
+    {
+        // successor of instruction i when it executes as op. code.size() stands for normal
+        // termination (any jump past the end), -1 for a jump before the start of the program.
+        expect_basic(code);
+        auto const n = static_cast<long>(code.size());
+        auto next = [&](long i, opcode op) -> long {
+            auto t = op == opcode::JMP ? i + code[i].val : i + 1;
+            return t < 0 ? -1 : std::min(t, n);
+        };
+
+        offset.resize(n + 2);
+        source.resize(n);
+        reaches_end.resize(n + 1);
+        seen.resize(n);
+
+        // reverse edges in compressed sparse row form
+        std::fill(offset.begin(), offset.end(), 0);
+        for (long i = 0; i < n; ++i) {
+            if (auto t = next(i, code[i].op); t >= 0) ++offset[t + 1];
+        }
+        std::partial_sum(offset.begin(), offset.end(), offset.begin());
+        for (long i = 0; i < n; ++i) {
+            if (auto t = next(i, code[i].op); t >= 0) source[offset[t]++] = i;
+        }
+        // offset[t] now points at the end of the sources of t
+        std::fill(reaches_end.begin(), reaches_end.end(), false);
+        reaches_end[n] = true;
+        queue.assign(1, n);
+        for (size_t k = 0; k < queue.size(); ++k) {
+            auto t = queue[k];
+            for (auto j = t > 0 ? offset[t - 1] : 0; j < offset[t]; ++j) {
+                if (!reaches_end[source[j]]) {
+                    reaches_end[source[j]] = true;
+                    queue.push_back(source[j]);
+                }
+            }
+        }
+        // the unpatched program already terminates, there is nothing to repair
+        if (reaches_end[0]) {
+            return std::nullopt;
+        }
+
+        std::fill(seen.begin(), seen.end(), false);
+        long p = 0;
+        int acc = 0;
+        while (p >= 0 && p < n && !seen[p]) {
+            seen[p] = true;
+            auto op = code[p].op;
+            if (op != opcode::ACC) {
+                auto alt = op == opcode::JMP ? opcode::NOP : opcode::JMP;
+                if (auto t = next(p, alt); t >= 0 && reaches_end[t]) {
+                    // the path from t is acyclic and does not come back to p, finish it with the patched successor
+                    auto patched = p;
+                    for (p = t; p < n; p = next(p, code[p].op)) {
+                        acc += code[p].op == opcode::ACC ? code[p].val : 0;
+                    }
+                    return { { patched, acc } };
+                }
+            }
+            acc += op == opcode::ACC ? code[p].val : 0;
+            p = next(p, op);
+        }
+        return std::nullopt;
+    }
+};
+
+// many programs loaded into one contiguous instruction arena, program i is code[offset[i], offset[i+1])
+struct program_batch {
+    std::vector<instruction> code;
+    std::vector<size_t> offset { 0 };
+
+    size_t size() const { return offset.size() - 1; }
+
+    gsl::span<instruction const> program(size_t i) const
+    {
+        return { code.data() + offset[i], offset[i + 1] - offset[i] };
+    }
+
+    enum class status { TERMINATED, LOOP, FAULT };
+
+    struct report {
+        status state;
+        int acc;        // at termination, or before the first repeated instruction
+        uint64_t steps; // instructions executed
+        std::optional<std::pair<long, int>> repair; // patched instruction and final acc, for looping programs
+    };
+
+    // runs every program on the thread pool, the visited bitmaps share one arena as well
+    std::vector<report> run() const
+    {
+        expect_basic(code);
+        std::vector<size_t> words(size() + 1, 0);
+        for (size_t i = 0; i < size(); ++i) {
+            words[i + 1] = words[i] + (offset[i + 1] - offset[i] + 63) / 64;
+        }
+        std::vector<uint64_t> visited(words.back(), 0);
+        std::vector<report> reports(size());
+
+        std::vector<size_t> indices(size());
+        std::iota(indices.begin(), indices.end(), 0);
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](size_t i) {
+            auto prog = program(i);
+            auto* bits = visited.data() + words[i];
+            auto const n = static_cast<long>(prog.size());
+
+            report r { status::LOOP, 0, 0, std::nullopt };
+            long p = 0;
+            while (true) {
+                if (p >= n) { r.state = status::TERMINATED; break; }
+                if (p < 0) { r.state = status::FAULT; break; }
+                auto& w = bits[p / 64];
+                auto m = uint64_t { 1 } << (p % 64);
+                if (w & m) break;
+                w |= m;
+                ++r.steps;
+                auto in = prog[p];
+                r.acc += in.op == opcode::ACC ? in.val : 0;
+                p += in.op == opcode::JMP ? in.val : 1;
+            }
+            if (r.state == status::LOOP) {
+                thread_local repair_engine repair;
+                r.repair = repair(prog);
+            }
+            reports[i] = r;
+        });
+        return reports;
+    }
+};
+
 int day08(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file.\n");
+        fmt::print("Provide an input file and optionally the length of a generated program to benchmark the interpreters on.\n");
         return 1;
     }
 
     std::ifstream in(argv[1]);
     std::string line;
 
-    std::vector<instruction> code;
+    // programs are separated by blank lines
+    program_batch batch;
 
     while(std::getline(in, line)) {
         if (line.empty()) {
+            if (batch.offset.back() != batch.code.size()) {
+                batch.offset.push_back(batch.code.size());
+            }
             continue;
         }
         auto tokens = split(line, ' ');
@@ -101,50 +533,77 @@ int day08(int argc, char** argv)
         if (!res.has_value()) {
             throw std::runtime_error(fmt::format("could not parse value {} into an int\n", tokens[1]));
         }
-        code.push_back(instruction { str_to_op(tokens[0]), res.value() });
+        batch.code.push_back(instruction { str_to_op(tokens[0]), res.value() });
+    }
+    if (batch.offset.back() != batch.code.size()) {
+        batch.offset.push_back(batch.code.size());
     }
 
+    if (batch.size() > 1) {
+        auto t0 = std::chrono::steady_clock::now();
+        auto reports = batch.run();
+        auto t1 = std::chrono::steady_clock::now();
+        auto seconds = std::chrono::duration<double>(t1 - t0).count();
+
+        uint64_t steps = 0;
+        for (size_t i = 0; i < reports.size(); ++i) {
+            auto const& r = reports[i];
+            steps += r.steps;
+            auto length = batch.offset[i + 1] - batch.offset[i];
+            switch (r.state) {
+            case program_batch::status::TERMINATED:
+                fmt::print("program {}: {} instructions, terminated, acc {}\n", i, length, r.acc);
+                break;
+            case program_batch::status::FAULT:
+                fmt::print("program {}: {} instructions, jumped before the start, acc {}\n", i, length, r.acc);
+                break;
+            case program_batch::status::LOOP:
+                if (r.repair.has_value()) {
+                    auto [patched, acc] = r.repair.value();
+                    fmt::print("program {}: {} instructions, loops with acc {}, repaired at {} with acc {}\n", i, length, r.acc, patched, acc);
+                } else {
+                    fmt::print("program {}: {} instructions, loops with acc {}, no repair\n", i, length, r.acc);
+                }
+                break;
+            }
+        }
+        fmt::print("total: {} programs, {} instructions executed in {:.3f} ms, {:.3g} instructions/s\n",
+            reports.size(), steps, seconds * 1e3, steps / seconds);
+        return 0;
+    }
+
+    auto& code = batch.code;
+
     vm vm(code);
 
     std::vector<int> idx(code.size(), false);
     vm.run(idx); 
-    fmt::print("part 1: {}\n", vm.A);
 
-    int ip = 0;
+    threaded_vm tvm(code);
+    tvm.run();
+    ENSURE(tvm.A == vm.A);
 
-    auto part2 = [&]() -> std::optional<int> {
-        vm.reset();
-        std::fill(idx.begin(), idx.end(), false);
-
-        while (true) {
-            if (idx[vm.P]) {
-                break;
-            }
+    block_program blocks(code);
+    auto summary = blocks.run();
+    ENSURE(summary.acc == vm.A);
+    fmt::print("part 1: {}\n", summary.acc);
+    if (!summary.terminated) {
+        auto const& entry = blocks.blocks[summary.loop_entry];
+        fmt::print("loop: {} blocks, enters at instruction {}, {} instructions and acc {:+d} per iteration\n",
+            blocks.blocks.size(), entry.start, summary.loop_len, summary.loop_acc);
+    }
 
-            auto &in = vm.code[vm.P];
-            if (in.op == opcode::JMP || in.op == opcode::NOP) {
-                auto op_old = in.op;
-                auto op_new = in.op == opcode::JMP ? opcode::NOP : opcode::JMP;
+    repair_engine repair;
 
-                in.op = op_new;
-                auto idx1 = idx;
-                struct vm vm1(vm);
-                if (vm1.run(idx1)) {
-                    return { vm1.A };
-                }
-                in.op = op_old;
-            }
-            idx[vm.P] = true;
-            vm.step();
-            if (vm.terminated_normally()) {
-                return { vm.A };
-            }
-        }
-        return std::nullopt;
-    };
-    auto res = part2();
-    if (res.has_value()) { 
-        fmt::print("part 2: {}\n", res.value());
+    auto res = repair(code);
+    if (summary.terminated) {
+        ENSURE(!res.has_value());
+        fmt::print("part 2: program already terminates\n");
+    } else if (res.has_value()) {
+        auto [patched, acc] = res.value();
+        fmt::print("part 2: {}\n", acc);
+        auto in = code[patched];
+        fmt::print("patched instruction {}: {} {:+d} -> {}\n", patched, names(in.op), in.val, in.op == opcode::JMP ? "nop" : "jmp");
     } else {
         fmt::print("part 2 no solution\n");
     }
@@ -152,7 +611,48 @@ int day08(int argc, char** argv)
     // performance benchmark
     ankerl::nanobench::Bench b;
     b.performanceCounters(true).minEpochIterations(10);
-    b.run("day8 perf", part2);
+    b.run("day8 repair", [&]() { return repair(code); });
+
+    // interpreter throughput on a generated straight-line program with short forward jumps
+    // a useful length is around 10^7 instructions and takes seconds, so it only runs when asked for
+    size_t length = argc > 2 ? parse_number<size_t>(argv[2]).value() : 0;
+    if (length == 0) {
+        return 0;
+    }
+    std::vector<instruction> program(length);
+    std::mt19937 rng(1234);
+    for (auto& in : program) {
+        auto r = rng() % 10;
+        in = r < 6 ? instruction { opcode::ACC, static_cast<int>(rng() % 201) - 100 }
+           : r < 8 ? instruction { opcode::NOP, static_cast<int>(rng() % 201) - 100 }
+                   : instruction { opcode::JMP, 1 + static_cast<int>(rng() % 3) };
+    }
+
+    struct vm ref(program);
+    std::vector<int> visited(program.size());
+    threaded_vm fast(program);
+    fast.reset();
+    fast.run();
+    ENSURE(ref.run(visited) && static_cast<int>(fast.A) == ref.A);
+    auto steps = fast.steps;
+    block_program compiled(program);
+    ENSURE(compiled.run().acc == fast.A);
+    // the generated program only jumps forward, so it terminates and must not be repaired
+    ENSURE(!repair(program).has_value());
+
+    b.minEpochIterations(1).batch(steps).unit("instruction");
+    b.run(fmt::format("switch vm, {} steps", steps), [&]() {
+        ref.reset();
+        std::fill(visited.begin(), visited.end(), false);
+        ref.run(visited);
+    });
+    b.run(fmt::format("threaded vm, {} steps", steps), [&]() {
+        fast.reset();
+        fast.run();
+    });
+    b.run(fmt::format("block vm, {} steps", steps), [&]() {
+        ankerl::nanobench::doNotOptimizeAway(compiled.run());
+    });
 
     return 0;
 }
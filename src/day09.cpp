@@ -1,5 +1,10 @@
+#include <array>
 #include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <execution>
 #include <functional>
+#include <iostream>
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
@@ -8,69 +13,324 @@
 #define ANKERL_NANOBENCH_IMPLEMENT
 #include "nanobench.h"
 
+// the last `preamble` values in arrival order, with a sorted copy of the same values for the pair
+// search. duplicates are kept as separate entries so that evicting one copy leaves the others.
+template <typename T>
+struct xmas_window {
+    explicit xmas_window(size_t preamble) : ring(preamble)
+    {
+        EXPECT(preamble > 0);
+        sorted.reserve(preamble);
+    }
+
+    bool full() const { return sorted.size() == ring.size(); }
+
+    // true if two entries with different values sum to x. a two-pointer walk over the sorted copy,
+    // when the ends sum to x but are equal, everything in between is equal too and no pair is left.
+    bool valid(T x) const
+    {
+        if (sorted.empty()) return false;
+        size_t l = 0, r = sorted.size() - 1;
+        while (l < r) {
+            auto s = sorted[l] + sorted[r];
+            if (s == x) {
+                return sorted[l] != sorted[r];
+            }
+            l += s < x;
+            r -= s > x;
+        }
+        return false;
+    }
+
+    // appends x and evicts the oldest value once the window is full
+    void push(T x)
+    {
+        if (full()) {
+            auto old = ring[head];
+            sorted.erase(std::lower_bound(sorted.begin(), sorted.end(), old));
+        }
+        ring[head] = x;
+        head = head + 1 == ring.size() ? 0 : head + 1;
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), x), x);
+    }
+
+    std::vector<T> ring;
+    std::vector<T> sorted;
+    size_t head { 0 };
+};
+
+// range minimum (or maximum) queries in O(1) after an O(n log n) build
+template <typename T, typename Op>
+struct sparse_table {
+    explicit sparse_table(gsl::span<T const> values, Op op = Op {}) : op(op), n(values.size())
+    {
+        levels.emplace_back(values.begin(), values.end());
+        for (size_t k = 1; (size_t { 1 } << k) <= n; ++k) {
+            auto const& prev = levels.back();
+            auto half = size_t { 1 } << (k - 1);
+            std::vector<T> level(n - (size_t { 1 } << k) + 1);
+            for (size_t i = 0; i < level.size(); ++i) {
+                level[i] = op(prev[i], prev[i + half]);
+            }
+            levels.push_back(std::move(level));
+        }
+    }
+
+    // query over [l, r), the range must not be empty
+    T query(size_t l, size_t r) const
+    {
+        auto k = 63 - __builtin_clzll(r - l);
+        return op(levels[k][l], levels[k][r - (size_t { 1 } << k)]);
+    }
+
+    Op op;
+    size_t n;
+    std::vector<std::vector<T>> levels;
+};
+
+// the last few prefix sums of a stream, enough to find a contiguous range with a given sum among
+// the most recent values without keeping the whole stream. the running sum of an endless stream
+// overflows, so the sums are kept modulo 2^64 where differences of prefixes stay exact.
+struct prefix_history {
+    explicit prefix_history(size_t capacity) : prefix(capacity + 1) { }
+
+    void push(int64_t x)
+    {
+        total += static_cast<uint64_t>(x);
+        prefix[(count + 1) % prefix.size()] = total;
+        ++count;
+    }
+
+    size_t size() const { return std::min(count, prefix.size() - 1); }
+
+    // the offset of the value at position i of the history
+    size_t offset(size_t i) const { return count - size() + i; }
+
+    // P[i] over the history, where i = 0 is the prefix just before the oldest kept value
+    uint64_t at(size_t i) const { return prefix[offset(i) % prefix.size()]; }
+
+    int64_t value(size_t i) const { return static_cast<int64_t>(at(i + 1) - at(i)); }
+
+    // the earliest starting range [l, r) of at least two kept values that sums to target
+    std::optional<std::pair<size_t, size_t>> find(int64_t target) const
+    {
+        robin_hood::unordered_map<uint64_t, size_t> first;
+        std::optional<std::pair<size_t, size_t>> best;
+        for (size_t r = 0; r <= size(); ++r) {
+            if (r >= 2) {
+                // prefixes are only visible to ends at least two positions later
+                first.try_emplace(at(r - 2), r - 2);
+                if (auto it = first.find(at(r) - static_cast<uint64_t>(target)); it != first.end()) {
+                    if (!best || it->second < best->first) {
+                        best = { it->second, r };
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+    std::vector<uint64_t> prefix;
+    uint64_t total { 0 };
+    size_t count { 0 };
+};
+
+// validates values as they arrive on the input stream and prints invalid ones immediately, together
+// with their weakness over the history that came before them. memory is bounded by the preamble and history sizes, not by the length of the stream.
+static int day09_stream(std::istream& in, size_t preamble, size_t history)
+{
+    xmas_window<int64_t> window(preamble);
+    prefix_history past(history);
+
+    // latencies are kept in a log2 histogram of nanoseconds, constant memory for any stream length
+    std::array<uint64_t, 64> latency {};
+    double total_ns = 0;
+    uint64_t max_ns = 0;
+
+    // the weakness of an invalid value, a range of at least two values before it that sums to it
+    auto weakness = [&](size_t at, int64_t target) {
+        if (auto range = past.find(target); range.has_value()) {
+            auto [l, r] = range.value();
+            int64_t lo = past.value(l), hi = lo;
+            for (auto i = l; i < r; ++i) {
+                lo = std::min(lo, past.value(i));
+                hi = std::max(hi, past.value(i));
+            }
+            fmt::print("weakness for {} at offset {}: {} (offsets {} to {})\n", target, at, lo + hi, past.offset(l), past.offset(r) - 1);
+        } else {
+            fmt::print("no weakness for {} in the last {} values\n", target, past.size());
+        }
+    };
+
+    size_t offset = 0;
+    size_t invalid = 0;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        auto t0 = std::chrono::steady_clock::now();
+        auto res = parse_number<int64_t>(line);
+        if (!res.has_value()) {
+            continue;
+        }
+        auto x = res.value();
+        if (window.full() && !window.valid(x)) {
+            fmt::print("invalid {} at offset {}\n", x, offset);
+            if (history > 0) {
+                weakness(offset, x);
+            }
+            std::fflush(stdout);
+            ++invalid;
+        }
+        window.push(x);
+        if (history > 0) {
+            past.push(x);
+        }
+        ++offset;
+        auto t1 = std::chrono::steady_clock::now();
+
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        latency[63 - __builtin_clzll(ns | 1)]++;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+    }
+
+    fmt::print("{} values, {} invalid\n", offset, invalid);
+    if (offset > 0) {
+        // the upper bound of the bucket that holds the 99th percentile
+        uint64_t seen = 0, p99 = 0;
+        for (size_t k = 0; k < latency.size(); ++k) {
+            seen += latency[k];
+            if (seen * 100 >= offset * 99) {
+                p99 = uint64_t { 2 } << k;
+                break;
+            }
+        }
+        fmt::print("latency per value: mean {:.0f} ns, p99 < {} ns, max {} ns\n", total_ns / offset, p99, max_ns);
+    }
+
+    return 0;
+}
+
 int day09(int argc, char** argv)
 {
     if (argc < 3) {
-        fmt::print("Provide an input file and a value for the preamble.\n");
+        fmt::print("Provide an input file (or - for stdin), a value for the preamble and optionally a history size.\n");
         return 1;
     }
 
+    auto preamble = parse_number<size_t>(argv[2]).value_or(0);
+    if (preamble < 1) {
+        fmt::print("The preamble must hold at least one value.\n");
+        return 1;
+    }
+
+    if (std::string_view(argv[1]) == "-") {
+        auto history = argc > 3 ? parse_number<size_t>(argv[3]).value() : 0;
+        return day09_stream(std::cin, preamble, history);
+    }
+
     std::ifstream in(argv[1]);
     std::string line;
 
-    std::vector<uint64_t> vec;
+    std::vector<int64_t> vec;
 
     while(std::getline(in, line)) {
         if (line.empty()) { continue; }
-        vec.push_back(parse_number<uint64_t>(line).value());
+        vec.push_back(parse_number<int64_t>(line).value());
     }
 
-    int preamble = parse_number<int>(argv[2]).value();
-
-    auto part1 = [&]() -> std::optional<uint64_t> {
-        robin_hood::unordered_set<uint64_t> values(vec.begin(), vec.begin() + preamble);
-        for (auto it = vec.begin() + preamble; it != vec.end(); ++it) {
-            bool has_sum = false;
-            for (auto it2 = it - preamble; it2 < it; ++it2) {
-                if (values.find(*it - *it2) != values.end()) {
-                    has_sum = true;
-                    break;
-                }
-            }
-            if (has_sum) {
-                values.erase(*(it - preamble));
-                values.insert(*it);
-                continue;
+    auto part1 = [&]() -> std::optional<int64_t> {
+        xmas_window<int64_t> window(preamble);
+        for (auto it = vec.begin(); it != vec.end(); ++it) {
+            if (window.full() && !window.valid(*it)) {
+                return { *it };
             }
-            return { *it };
+            window.push(*it);
         }
         return std::nullopt;
     };
 
-    auto part2 = [&](uint64_t target) -> std::optional<uint64_t> {
-        auto l = vec.begin();
-        auto r = vec.begin();
-        auto total = uint64_t{0};
+    // every contiguous range [l, r) of at least two values that sums to target. with prefix sums
+    // P, these are the pairs l < r - 1 with P[l] = P[r] - target, found through a hash index over
+    // the prefix values. this also works for negative values. the ends r are split into chunks that
+    // are scanned in parallel, the index is shared so ranges across chunk boundaries need no stitching.
+    std::vector<int64_t> prefix(vec.size() + 1, 0);
 
-        while (total != target || r - l < 2) {
-            total = total < target ? total + *r++ : total - *l++;
+    auto find_ranges = [&](int64_t target) {
+        std::inclusive_scan(std::execution::par, vec.begin(), vec.end(), prefix.begin() + 1);
+
+        robin_hood::unordered_map<int64_t, std::vector<uint32_t>> index;
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            index[prefix[i]].push_back(i);
         }
-        auto [min, max] = std::minmax_element(l, r);
-        return { *min + *max };
 
-        return std::nullopt;
+        auto found = parallel_chunks(prefix.size(), [&](size_t begin, size_t end) {
+            std::vector<std::pair<uint32_t, uint32_t>> f;
+            for (size_t r = begin; r < end; ++r) {
+                if (auto it = index.find(prefix[r] - target); it != index.end()) {
+                    for (auto l : it->second) {
+                        if (l + 1 >= r) break;
+                        f.emplace_back(l, r);
+                    }
+                }
+            }
+            return f;
+        });
+
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        for (auto const& f : found) {
+            ranges.insert(ranges.end(), f.begin(), f.end());
+        }
+        std::sort(ranges.begin(), ranges.end());
+        return ranges;
+    };
+
+    // the tables only depend on the input, they are built once and part 2 only runs the queries
+    auto min = [](int64_t a, int64_t b) { return std::min(a, b); };
+    auto max = [](int64_t a, int64_t b) { return std::max(a, b); };
+    sparse_table<int64_t, decltype(min)> mins(vec, min);
+    sparse_table<int64_t, decltype(max)> maxs(vec, max);
+
+    // every range that sums to target with its weakness, the sum of its smallest and largest value
+    struct weakness {
+        uint32_t l, r;
+        int64_t value;
+    };
+
+    auto part2 = [&](int64_t target) {
+        auto ranges = find_ranges(target);
+        std::vector<weakness> result;
+        result.reserve(ranges.size());
+        for (auto [l, r] : ranges) {
+            result.push_back({ l, r, mins.query(l, r) + maxs.query(l, r) });
+        }
+        return result;
     };
 
     auto p1 = part1();
+    if (!p1.has_value()) {
+        fmt::print("part 1 no solution\n");
+        return 0;
+    }
     auto p2 = part2(p1.value());
 
     fmt::print("part 1: {}\n", p1.value());
-    fmt::print("part 2: {}\n", p2.value());
+    if (!p2.empty()) {
+        fmt::print("part 2: {}\n", p2.front().value);
+    } else {
+        fmt::print("part 2 no solution\n");
+    }
+    if (p2.size() > 1) {
+        fmt::print("{} ranges sum to {}:\n", p2.size(), p1.value());
+        for (auto const& w : p2) {
+            fmt::print("  [{}, {}): {}\n", w.l, w.r, w.value);
+        }
+    }
 
     ankerl::nanobench::Bench b;
     b.performanceCounters(true).minEpochIterations(100);
-    b.run("part 1", [&]() { part1(); });
-    b.run("part 2", [&]() { part2(p1.value()); });
+    b.run("part 1", [&]() { ankerl::nanobench::doNotOptimizeAway(part1()); });
+    b.run("part 2", [&]() { ankerl::nanobench::doNotOptimizeAway(part2(p1.value())); });
 
     return 0;
 }
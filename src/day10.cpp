@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <array>
 #include <bitset>
+#include <execution>
 #include <functional>
 #include <stack>
 #include <fmt/format.h>
@@ -10,10 +12,326 @@
 #define ANKERL_NANOBENCH_IMPLEMENT
 #include "nanobench.h"
 
+namespace joltage {
+    // arbitrary precision unsigned integer, 32-bit limbs with the least significant first.
+    // zero has no limbs and there are never leading zero limbs.
+    struct biguint {
+        biguint(uint64_t x = 0)
+        {
+            for (; x != 0; x >>= 32) {
+                limbs.push_back(static_cast<uint32_t>(x));
+            }
+        }
+
+        biguint& operator+=(biguint const& other)
+        {
+            if (limbs.size() < other.limbs.size()) {
+                limbs.resize(other.limbs.size(), 0);
+            }
+            uint64_t carry = 0;
+            for (size_t i = 0; i < limbs.size(); ++i) {
+                uint64_t s = carry + limbs[i] + (i < other.limbs.size() ? other.limbs[i] : 0);
+                limbs[i] = static_cast<uint32_t>(s);
+                carry = s >> 32;
+                if (carry == 0 && i >= other.limbs.size()) {
+                    break;
+                }
+            }
+            if (carry != 0) {
+                limbs.push_back(static_cast<uint32_t>(carry));
+            }
+            return *this;
+        }
+
+        friend biguint operator+(biguint a, biguint const& b) { return a += b; }
+
+        friend biguint operator*(biguint const& a, biguint const& b)
+        {
+            biguint r;
+            if (a.limbs.empty() || b.limbs.empty()) {
+                return r;
+            }
+            r.limbs.assign(a.limbs.size() + b.limbs.size(), 0);
+            for (size_t i = 0; i < a.limbs.size(); ++i) {
+                uint64_t carry = 0;
+                for (size_t j = 0; j < b.limbs.size(); ++j) {
+                    uint64_t t = uint64_t { a.limbs[i] } * b.limbs[j] + r.limbs[i + j] + carry;
+                    r.limbs[i + j] = static_cast<uint32_t>(t);
+                    carry = t >> 32;
+                }
+                r.limbs[i + b.limbs.size()] = static_cast<uint32_t>(carry);
+            }
+            while (!r.limbs.empty() && r.limbs.back() == 0) {
+                r.limbs.pop_back();
+            }
+            return r;
+        }
+
+        bool operator==(biguint const& other) const { return limbs == other.limbs; }
+
+        size_t bits() const { return limbs.empty() ? 0 : 32 * limbs.size() - __builtin_clz(limbs.back()); }
+
+        // the low 64 bits, what a uint64_t computation would have wrapped around to
+        uint64_t low() const
+        {
+            uint64_t x = 0;
+            for (size_t i = 0; i < std::min<size_t>(2, limbs.size()); ++i) {
+                x |= uint64_t { limbs[i] } << (32 * i);
+            }
+            return x;
+        }
+
+        // decimal digits by repeated division with 10^9
+        std::string str() const
+        {
+            if (limbs.empty()) {
+                return "0";
+            }
+            std::vector<uint32_t> q(limbs);
+            std::vector<uint32_t> parts;
+            while (!q.empty()) {
+                uint64_t rem = 0;
+                for (size_t i = q.size(); i-- > 0;) {
+                    auto cur = (rem << 32) | q[i];
+                    q[i] = static_cast<uint32_t>(cur / 1'000'000'000);
+                    rem = cur % 1'000'000'000;
+                }
+                while (!q.empty() && q.back() == 0) {
+                    q.pop_back();
+                }
+                parts.push_back(static_cast<uint32_t>(rem));
+            }
+            auto result = fmt::format("{}", parts.back());
+            for (size_t i = parts.size() - 1; i-- > 0;) {
+                result += fmt::format("{:09}", parts[i]);
+            }
+            return result;
+        }
+
+        std::vector<uint32_t> limbs;
+    };
+
+    // the allowed joltage jumps as a bit mask, the puzzle allows 1, 2 and 3
+    struct gap_set {
+        uint32_t mask { 0b1110 };
+        int max { 3 };
+
+        bool contains(int d) const { return d > 0 && d <= max && ((mask >> d) & 1); }
+
+        // a comma separated list such as 1,3,4
+        static gap_set parse(std::string const& s)
+        {
+            gap_set g { 0, 0 };
+            for (auto const& t : split(s, ',')) {
+                auto d = parse_number<int>(t);
+                if (!d.has_value() || d.value() < 1 || d.value() > 31) {
+                    throw std::runtime_error(fmt::format("cannot parse a gap between 1 and 31 from {}\n", t));
+                }
+                g.mask |= 1u << d.value();
+                g.max = std::max(g.max, d.value());
+            }
+            if (g.mask == 0) {
+                throw std::runtime_error("the gap set is empty\n");
+            }
+            return g;
+        }
+    };
+
+    // the counting engine is generic over the arithmetic: exact big integers or residues modulo a prime
+    struct exact_ring {
+        using value_type = biguint;
+        value_type zero() const { return {}; }
+        value_type one() const { return { 1 }; }
+        value_type add(value_type a, value_type const& b) const { return a += b; }
+        value_type mul(value_type const& a, value_type const& b) const { return a * b; }
+    };
+
+    struct mod_ring {
+        using value_type = uint64_t;
+        uint64_t p;
+        value_type zero() const { return 0; }
+        value_type one() const { return 1 % p; }
+        // a + b can wrap around 2^64 for p above 2^63, so compare against p - b instead
+        value_type add(value_type a, value_type b) const { return a >= p - b ? a - (p - b) : a + b; }
+        value_type mul(value_type a, value_type b) const { return static_cast<uint64_t>(static_cast<unsigned __int128>(a) * b % p); }
+    };
+
+    // splits the chain at the adapters that every arrangement passes through, those that no allowed
+    // jump can skip. consecutive intervals share the cut adapter, so the number of arrangements is
+    // the product of the counts of the intervals.
+    static std::vector<gsl::span<int const>> intervals(gsl::span<int const> u, gap_set gaps = {})
+    {
+        std::vector<gsl::span<int const>> result;
+        size_t a = 0;
+        for (size_t k = 1; k + 1 < u.size(); ++k) {
+            if (u[k + 1] - u[k - 1] > gaps.max) {
+                result.push_back(u.subspan(a, k - a + 1));
+                a = k;
+            }
+        }
+        if (!u.empty()) {
+            result.push_back(u.subspan(a));
+        }
+        return result;
+    }
+
+    // arrangements from the first to the last adapter of u. the adapters are distinct and sorted,
+    // so at most the next max gap adapters can be reached and a window of that many counts
+    // (three for the puzzle) replaces the O(n) table.
+    template <typename Ring>
+    typename Ring::value_type count(gsl::span<int const> u, Ring const& ring, gap_set gaps = {})
+    {
+        std::vector<typename Ring::value_type> w(gaps.max, ring.zero());
+        w[0] = ring.one();
+        for (size_t i = u.size() - 1; i-- > 0;) {
+            if (u[i + 1] <= u[i]) {
+                throw std::runtime_error(fmt::format("adapter {} appears more than once\n", u[i]));
+            }
+            auto c = ring.zero();
+            for (size_t k = 0; k < w.size() && i + 1 + k < u.size() && u[i + 1 + k] - u[i] <= gaps.max; ++k) {
+                if (gaps.contains(u[i + 1 + k] - u[i])) {
+                    c = ring.add(std::move(c), w[k]);
+                }
+            }
+            std::rotate(w.rbegin(), w.rbegin() + 1, w.rend());
+            w[0] = std::move(c);
+        }
+        return w[0];
+    }
+
+    // the intervals are counted in parallel and combined with a product reduction
+    template <typename Ring>
+    typename Ring::value_type arrangements(gsl::span<int const> u, Ring const& ring, gap_set gaps = {})
+    {
+        auto ivs = intervals(u, gaps);
+        return std::transform_reduce(std::execution::par, ivs.begin(), ivs.end(), ring.one(),
+            [&](auto const& a, auto const& b) { return ring.mul(a, b); },
+            [&](auto iv) { return count(iv, ring, gaps); });
+    }
+
+    // counting with transfer matrices over the joltages. the state holds the counts of the last
+    // max gap joltages, f(x), f(x - 1), ..., and one step to x + 1 is a multiplication with P when
+    // there is an adapter at x + 1 and with A when there is none. a gap d between adapters is the
+    // matrix S_d = P A^(d - 1), a run of equal gaps is a matrix power and the runs are multiplied
+    // in parallel chunks. the entries live in the same rings as the counting engine.
+    template <typename Ring>
+    struct transfer {
+        using value_type = typename Ring::value_type;
+
+        // a square matrix of ring elements in row-major order
+        struct matrix {
+            size_t k;
+            std::vector<value_type> a;
+
+            value_type& operator()(size_t i, size_t j) { return a[i * k + j]; }
+            value_type const& operator()(size_t i, size_t j) const { return a[i * k + j]; }
+        };
+
+        transfer(Ring const& ring, gap_set gaps) : ring(ring), gaps(gaps)
+        {
+            auto k = gaps.max;
+            matrix shift = zero();
+            for (int d = 1; d < k; ++d) {
+                shift(d, d - 1) = ring.one();
+            }
+            matrix present = shift;
+            for (int g = 1; g <= k; ++g) {
+                present(0, g - 1) = gaps.contains(g) ? ring.one() : ring.zero();
+            }
+            // S_d for every gap up to the max, larger gaps cannot be jumped
+            matrix absent = identity();
+            for (int d = 1; d <= k; ++d) {
+                step.push_back(mul(present, absent));
+                absent = mul(shift, absent);
+            }
+        }
+
+        matrix zero() const
+        {
+            auto k = static_cast<size_t>(gaps.max);
+            return { k, std::vector<value_type>(k * k, ring.zero()) };
+        }
+
+        matrix identity() const
+        {
+            auto m = zero();
+            for (size_t i = 0; i < m.k; ++i) {
+                m(i, i) = ring.one();
+            }
+            return m;
+        }
+
+        // the step matrices are mostly zero, so zero entries on the left are skipped
+        matrix mul(matrix const& x, matrix const& y) const
+        {
+            auto const z = ring.zero();
+            auto r = zero();
+            for (size_t i = 0; i < r.k; ++i) {
+                for (size_t l = 0; l < r.k; ++l) {
+                    if (x(i, l) == z) continue;
+                    for (size_t j = 0; j < r.k; ++j) {
+                        r(i, j) = ring.add(std::move(r(i, j)), ring.mul(x(i, l), y(l, j)));
+                    }
+                }
+            }
+            return r;
+        }
+
+        matrix power(matrix m, size_t e) const
+        {
+            matrix r = identity();
+            for (; e > 0; e >>= 1) {
+                if (e & 1) r = mul(m, r);
+                if (e > 1) m = mul(m, m);
+            }
+            return r;
+        }
+
+        value_type operator()(gsl::span<int const> u, size_t nchunks = 0) const
+        {
+            // runs of equal gaps as (gap, length)
+            std::vector<std::pair<int, size_t>> runs;
+            for (size_t i = 1; i < u.size(); ++i) {
+                auto d = u[i] - u[i - 1];
+                if (d < 1) {
+                    throw std::runtime_error(fmt::format("adapter {} appears more than once\n", u[i - 1]));
+                }
+                // a gap larger than any allowed jump cannot be crossed
+                if (d > gaps.max) {
+                    return ring.zero();
+                }
+                if (!runs.empty() && runs.back().first == d) {
+                    ++runs.back().second;
+                } else {
+                    runs.emplace_back(d, 1);
+                }
+            }
+            // later steps multiply from the left, so the chunk products are folded in order
+            auto products = parallel_chunks(runs.size(), [&](size_t begin, size_t end) {
+                matrix m = identity();
+                for (auto i = begin; i < end; ++i) {
+                    auto [d, n] = runs[i];
+                    m = mul(n == 1 ? step[d - 1] : power(step[d - 1], n), m);
+                }
+                return m;
+            }, nchunks);
+            matrix total = identity();
+            for (auto const& m : products) {
+                total = mul(m, total);
+            }
+            return total(0, 0);
+        }
+
+        Ring ring;
+        gap_set gaps;
+        std::vector<matrix> step;
+    };
+} // namespace joltage
+
 int day10(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file and a value for the preamble.\n");
+        fmt::print("Provide an input file, optionally a prime modulus (0 for none), a generated chain length and a set of gaps such as 1,2,3.\n");
         return 1;
     }
 
@@ -39,54 +357,30 @@ int day10(int argc, char** argv)
     a += v.front() == 1;
     fmt::print("part 1: {}\n", a * b);
 
-    std::vector<int> counts;
+    auto gaps = argc > 4 ? joltage::gap_set::parse(argv[4]) : joltage::gap_set {};
 
+    // the device is rated the largest gap above the highest adapter
     std::vector<int> u {0};
     std::copy(v.begin(), v.end(), std::back_inserter(u));
-    u.push_back(u.back()+3);
-
-    auto get_intervals = [](gsl::span<int> u) {
-        std::vector<gsl::span<int>> intervals;
-        for(size_t i = 0; i < u.size(); ++i) {
-            size_t j = i+1;
-            while(j < u.size() && u[j] - u[i] <= 3) {
-                ++j;
-            }
-
-            if (intervals.empty()) {
-                intervals.push_back({ u.data() + i, j - i });
-                continue;
-            }
-            auto iv = intervals.back();
-            auto a = iv.data() - u.data();
-            auto b = a + iv.size();
-
-            if (b > i) {
-                iv = gsl::span(iv.data(), j);
-                intervals.back() = iv;
-            } else {
-                intervals.push_back({ u.data() + i, j - i });
-            }
-        }
-        return intervals;
-    };
+    u.push_back(u.back() + gaps.max);
 
-    auto part2 = [](gsl::span<int> u) -> uint64_t {
+    auto part2 = [&](gsl::span<int const> u) -> uint64_t {
         std::vector<uint64_t> counts(u.size(), 0);
         counts.back() = 1;
 
         for(int i = u.size() - 2; i >= 0; --i) {
             for (size_t j = i + 1; j < u.size(); ++j) {
-                if (u[j] - u[i] > 3)
+                if (u[j] - u[i] > gaps.max)
                     break;
-                counts[i] += counts[j];
+                if (gaps.contains(u[j] - u[i]))
+                    counts[i] += counts[j];
             }
         }
         return counts.front(); 
     };
 
-    auto part2_hyb = [&](gsl::span<int> u) -> uint64_t {
-        auto intervals = get_intervals(u);
+    auto part2_hyb = [&](gsl::span<int const> u) -> uint64_t {
+        auto intervals = joltage::intervals(u, gaps);
         auto p = std::transform_reduce(intervals.begin(), intervals.end(), uint64_t{1}, std::multiplies{}, [&](auto iv) { return part2(iv); });
         return p;
     };
@@ -96,10 +390,71 @@ int day10(int argc, char** argv)
     fmt::print("part 2 (dyn): {}\n", p2_dyn);
     fmt::print("part 2 (hyb): {}\n", p2_hyb);
 
+    joltage::transfer part2_transfer(joltage::exact_ring {}, gaps);
+    fmt::print("part 2 (transfer): {}\n", part2_transfer(u).str());
+
+    auto p2_exact = joltage::arrangements(u, joltage::exact_ring {}, gaps);
+    fmt::print("part 2 (exact): {}\n", p2_exact.str());
+
+    std::optional<joltage::mod_ring> mod;
+    if (argc > 2 && parse_number<uint64_t>(argv[2]).value() != 0) {
+        mod = joltage::mod_ring { parse_number<uint64_t>(argv[2]).value() };
+        fmt::print("part 2 (mod {}): {}\n", mod->p, joltage::arrangements(u, mod.value(), gaps));
+    }
+
     ankerl::nanobench::Bench bench;
     bench.performanceCounters(true).minEpochIterations(10000);
     bench.run("part 2 dyn", [&]() { part2(u); });
     bench.run("part 2 dyn+hyb", [&]() { part2_hyb(u); });
+    bench.run("part 2 transfer", [&]() { ankerl::nanobench::doNotOptimizeAway(part2_transfer(u)); });
+
+    // a long generated chain where the uint64_t counts overflow, the jumps are drawn from the gap set
+    size_t length = argc > 3 ? parse_number<size_t>(argv[3]).value() : 100'000;
+    std::vector<int> allowed;
+    for (int d = 1; d <= gaps.max; ++d) {
+        if (gaps.contains(d)) allowed.push_back(d);
+    }
+    std::vector<int> chain { 0 };
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> gap(0, allowed.size() - 1);
+    for (size_t i = 1; i < length; ++i) {
+        chain.push_back(chain.back() + allowed[gap(rng)]);
+    }
+    auto big = joltage::arrangements(chain, joltage::exact_ring {}, gaps);
+    fmt::print("generated chain of {} adapters: the number of arrangements has {} bits\n", length, big.bits());
+
+    // the differential check, the transfer matrices must give the exact count and the uint64_t
+    // paths must agree with it modulo 2^64
+    auto dyn = part2(chain), hyb = part2_hyb(chain);
+    if (auto tm = part2_transfer(chain); !(tm == big)) {
+        throw std::runtime_error(fmt::format("counts differ: transfer {}, exact {}\n", tm.str(), big.str()));
+    }
+    if (big.low() != dyn || hyb != dyn) {
+        throw std::runtime_error(fmt::format("counts differ: dyn {}, hyb {}, exact {}\n", dyn, hyb, big.low()));
+    }
+
+    // a modulus close to 2^64, where residue sums wrap around. the chain 0, 1, ..., 300 with the
+    // puzzle gaps has the 300th tribonacci number of arrangements.
+    std::vector<int> consecutive(301);
+    std::iota(consecutive.begin(), consecutive.end(), 0);
+    joltage::mod_ring const wide { 18'446'744'073'709'551'557ull }; // 2^64 - 59
+    for (auto r : { joltage::arrangements(consecutive, wide), joltage::transfer(wide, {})(consecutive) }) {
+        if (r != 14'775'746'092'297'300'593ull) {
+            throw std::runtime_error(fmt::format("count modulo {} is {}, expected 14775746092297300593\n", wide.p, r));
+        }
+    }
+
+    bench.minEpochIterations(1);
+    bench.run(fmt::format("generated {} dyn", length), [&]() { ankerl::nanobench::doNotOptimizeAway(part2(chain)); });
+    bench.run(fmt::format("generated {} dyn+hyb", length), [&]() { ankerl::nanobench::doNotOptimizeAway(part2_hyb(chain)); });
+    bench.run(fmt::format("generated {} exact", length), [&]() { ankerl::nanobench::doNotOptimizeAway(joltage::arrangements(chain, joltage::exact_ring {}, gaps)); });
+    if (mod.has_value()) {
+        bench.run(fmt::format("generated {} mod {}", length, mod->p), [&]() { ankerl::nanobench::doNotOptimizeAway(joltage::arrangements(chain, mod.value(), gaps)); });
+        // exact transfer matrices grow with the chain, the residues keep the products at constant size
+        joltage::transfer mod_transfer(mod.value(), gaps);
+        ENSURE(mod_transfer(chain) == joltage::arrangements(chain, mod.value(), gaps));
+        bench.run(fmt::format("generated {} transfer mod {}", length, mod->p), [&]() { ankerl::nanobench::doNotOptimizeAway(mod_transfer(chain)); });
+    }
 
     return 0;
 }
@@ -1,7 +1,15 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
 #include <stack>
+#include <thread>
 #include <fmt/format.h>
 #include "advent.hpp"
 #include "util.hpp"
@@ -10,10 +18,304 @@
 #define ANKERL_NANOBENCH_IMPLEMENT
 #include "nanobench.h"
 
+namespace seating {
+    using A = Eigen::Array<char, -1, -1>;
+
+    static constexpr std::array<std::pair<int, int>, 8> directions { {
+        { -1, -1 }, { -1, 0 }, { -1, 1 }, { 0, -1 }, { 0, 1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }
+    } };
+
+    // a rule is the neighbourhood a seat looks at and the number of occupied neighbours that makes
+    // an occupied seat empty. an empty seat is taken when none of its neighbours are occupied.
+    struct rule {
+        bool line_of_sight;
+        int tolerance;
+
+        // adjacent:4 or sight:5. a tolerance of 0 would empty every occupied seat unconditionally,
+        // so it has to be at least 1.
+        static rule parse(std::string const& s)
+        {
+            auto tokens = split(s, ':');
+            auto tolerance = tokens.size() == 2 ? parse_number<int>(tokens[1]) : std::nullopt;
+            if (!tolerance.has_value() || (tokens[0] != "adjacent" && tokens[0] != "sight")) {
+                throw std::runtime_error(fmt::format("cannot parse a rule from {}, expected adjacent:N or sight:N\n", s));
+            }
+            if (tolerance.value() < 1) {
+                throw std::runtime_error(fmt::format("the tolerance in {} must be at least 1\n", s));
+            }
+            return { tokens[0] == "sight", tolerance.value() };
+        }
+    };
+
+    static constexpr rule part1 { false, 4 };
+    static constexpr rule part2 { true, 5 };
+
+    // the seats and, for every seat, the indices of the seats it looks at. the neighbours never
+    // change, so they are found once and every generation works on a seat-only state array.
+    // missing neighbours point at index n, a slot in the state that is always empty.
+    struct graph {
+        uint32_t n { 0 };
+        std::vector<std::pair<int, int>> position; // (row, col) of every seat
+        std::vector<uint32_t> next;                // 8 per seat
+
+        // the adjacent seats, or with line_of_sight the first seat in every direction
+        graph(A const& a, bool line_of_sight)
+        {
+            int const nrow = a.rows(), ncol = a.cols();
+            auto const none = std::numeric_limits<uint32_t>::max();
+            std::vector<uint32_t> id(a.size(), none);
+            Eigen::Array<char, -1, -1, Eigen::RowMajor> cells = a;
+            for (int i = 0; i < nrow; ++i) {
+                for (int j = 0; j < ncol; ++j) {
+                    if (cells(i, j) != '.') {
+                        id[i * ncol + j] = n++;
+                        position.emplace_back(i, j);
+                    }
+                }
+            }
+            next.assign(8 * size_t { n }, n);
+
+            // the first four directions look at cells that come earlier in row-major order and the
+            // last four at cells that come later, so a forward and a backward sweep find every
+            // neighbour. the first seat seen from each cell is kept for the current and previous row.
+            auto sweep = [&](bool forward) {
+                std::vector<uint32_t> prev(4 * size_t(ncol), none), cur(4 * size_t(ncol), none);
+                for (int r = 0; r < nrow; ++r) {
+                    int i = forward ? r : nrow - 1 - r;
+                    for (int c = 0; c < ncol; ++c) {
+                        int j = forward ? c : ncol - 1 - c;
+                        auto s = id[i * ncol + j];
+                        for (int q = 0; q < 4; ++q) {
+                            auto k = forward ? q : 7 - q;
+                            auto [di, dj] = directions[k];
+                            int u = i + di, v = j + dj;
+                            uint32_t t = none;
+                            if (u >= 0 && v >= 0 && u < nrow && v < ncol) {
+                                t = id[u * ncol + v];
+                                if (t == none && line_of_sight) {
+                                    t = (u == i ? cur : prev)[4 * v + q];
+                                }
+                            }
+                            cur[4 * j + q] = t;
+                            if (s != none && t != none) {
+                                next[8 * size_t { s } + k] = t;
+                            }
+                        }
+                    }
+                    std::swap(prev, cur);
+                }
+            };
+            sweep(true);
+            sweep(false);
+        }
+
+        // one bit per seat plus the empty slot at the end
+        std::vector<uint8_t> state(A const& a) const
+        {
+            std::vector<uint8_t> x(n + 1, 0);
+            for (uint32_t s = 0; s < n; ++s) {
+                x[s] = a(position[s].first, position[s].second) == '#';
+            }
+            return x;
+        }
+
+        // one generation from in to out for the seats in [lo, hi), returns the number of seats that changed
+        size_t step(uint8_t const* in, uint8_t* out, int tolerance, uint32_t lo = 0, uint32_t hi = std::numeric_limits<uint32_t>::max()) const
+        {
+            size_t changed = 0;
+            hi = std::min(hi, n);
+            for (uint32_t s = lo; s < hi; ++s) {
+                auto const* nb = next.data() + 8 * size_t { s };
+                int occupied = in[nb[0]] + in[nb[1]] + in[nb[2]] + in[nb[3]] + in[nb[4]] + in[nb[5]] + in[nb[6]] + in[nb[7]];
+                uint8_t x = in[s];
+                uint8_t y = x ? occupied < tolerance : occupied == 0;
+                out[s] = y;
+                changed += x != y;
+            }
+            return changed;
+        }
+    };
+
+    // runs the rule to its fixpoint, re-evaluating only the seats that changed in the previous
+    // generation and the seats that see one of them; visibility is symmetric, so these are the
+    // changed seats and their neighbours. a seat that did not change and whose neighbours did not
+    // change evaluates to the same state again. a changed seat is rechecked itself because the rule
+    // can flip it on its own state alone, e.g. an isolated seat under a tolerance of 0. the frontier
+    // is a bitmap over the seats so that it is visited in memory order. the two state buffers are
+    // swapped after every generation and only the changed seats are copied back into the old one.
+    struct simulation {
+        simulation(graph const& g, std::vector<uint8_t> initial, int tolerance)
+            : g(g), tolerance(tolerance), cur(std::move(initial)), nxt(cur)
+            , dirty(g.n / 64 + 1, ~uint64_t { 0 }), next_dirty(dirty.size(), 0)
+        {
+            // the bitmaps have room for the empty slot n, which is never evaluated
+            dirty.back() = (uint64_t { 1 } << (g.n % 64)) - 1;
+        }
+
+        // one generation over the frontier, returns the number of seats that changed
+        size_t step()
+        {
+            changed.clear();
+            for (size_t w = 0; w < dirty.size(); ++w) {
+                auto bits = dirty[w];
+                evaluated += __builtin_popcountll(bits);
+                for (; bits != 0; bits &= bits - 1) {
+                    uint32_t s = 64 * w + __builtin_ctzll(bits);
+                    auto const* nb = g.next.data() + 8 * size_t { s };
+                    int occupied = cur[nb[0]] + cur[nb[1]] + cur[nb[2]] + cur[nb[3]] + cur[nb[4]] + cur[nb[5]] + cur[nb[6]] + cur[nb[7]];
+                    uint8_t x = cur[s];
+                    uint8_t y = x ? occupied < tolerance : occupied == 0;
+                    nxt[s] = y;
+                    if (x != y) {
+                        changed.push_back(s);
+                        next_dirty[s / 64] |= uint64_t { 1 } << (s % 64);
+                        for (int k = 0; k < 8; ++k) {
+                            next_dirty[nb[k] / 64] |= uint64_t { 1 } << (nb[k] % 64);
+                        }
+                    }
+                }
+            }
+            std::swap(cur, nxt);
+            for (auto s : changed) {
+                nxt[s] = cur[s];
+            }
+            // the empty slot is marked through missing neighbours
+            next_dirty.back() &= ~(uint64_t { 1 } << (g.n % 64));
+            std::swap(dirty, next_dirty);
+            std::fill(next_dirty.begin(), next_dirty.end(), 0);
+            ++generation;
+            return changed.size();
+        }
+
+        // not every layout settles, some oscillate. returns false if there is no fixpoint within limit generations.
+        bool run(uint32_t limit = std::numeric_limits<uint32_t>::max())
+        {
+            while (step() != 0) {
+                if (generation >= limit) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t occupied() const { return std::accumulate(cur.begin(), cur.end(), size_t { 0 }); }
+
+        graph const& g;
+        int tolerance;
+        std::vector<uint8_t> cur, nxt;
+        std::vector<uint64_t> dirty, next_dirty;
+        std::vector<uint32_t> changed;
+        uint32_t generation { 0 };
+        size_t evaluated { 0 };
+    };
+
+    // the threads of the banded stepper meet here after every generation
+    class barrier {
+    public:
+        explicit barrier(size_t count) : count(count) { }
+
+        void arrive_and_wait()
+        {
+            std::unique_lock lock(mutex);
+            auto p = phase;
+            if (++waiting == count) {
+                waiting = 0;
+                ++phase;
+                cv.notify_all();
+            } else {
+                cv.wait(lock, [&]() { return phase != p; });
+            }
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t count;
+        size_t waiting { 0 };
+        size_t phase { 0 };
+    };
+
+    // steps every seat on a fixed number of threads, each owning a band of rows. the seats are
+    // numbered row by row, so a band is a contiguous range of seats. the halo, the rows just
+    // outside a band that its seats look at, is read from the shared buffer of the previous
+    // generation, which is stable until all threads have passed the barrier.
+    struct banded {
+        banded(graph const& g, int tolerance, size_t nthreads) : g(g), tolerance(tolerance)
+        {
+            // split at row boundaries into bands with roughly the same number of seats
+            bounds.push_back(0);
+            for (size_t t = 1; t < nthreads; ++t) {
+                uint32_t s = g.n * t / nthreads;
+                while (s > bounds.back() && s < g.n && g.position[s].first == g.position[s - 1].first) {
+                    ++s;
+                }
+                bounds.push_back(std::max(s, bounds.back()));
+            }
+            bounds.push_back(g.n);
+        }
+
+        // the state at the fixpoint and the number of generations, counting the one that confirms it.
+        // stops after limit generations like simulation::run.
+        std::pair<std::vector<uint8_t>, uint32_t> run(std::vector<uint8_t> state, uint32_t limit = std::numeric_limits<uint32_t>::max()) const
+        {
+            auto nthreads = bounds.size() - 1;
+            std::vector<uint8_t> x = std::move(state), y = x;
+            std::atomic<size_t> changed { 0 };
+            uint32_t generations = 0;
+            bool done = false;
+            barrier sync(nthreads);
+
+            auto work = [&](size_t t) {
+                while (true) {
+                    changed += g.step(x.data(), y.data(), tolerance, bounds[t], bounds[t + 1]);
+                    sync.arrive_and_wait();
+                    if (t == 0) {
+                        ++generations;
+                        done = changed == 0 || generations >= limit;
+                        changed = 0;
+                        std::swap(x, y);
+                    }
+                    sync.arrive_and_wait();
+                    if (done) {
+                        break;
+                    }
+                }
+            };
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < nthreads; ++t) {
+                threads.emplace_back(work, t);
+            }
+            work(0);
+            for (auto& t : threads) {
+                t.join();
+            }
+            return { x, generations };
+        }
+
+        graph const& g;
+        int tolerance;
+        std::vector<uint32_t> bounds;
+    };
+
+    // a random layout with roughly three quarters of the cells being seats
+    static A generate(int nrow, int ncol, uint32_t seed)
+    {
+        std::mt19937 rng(seed);
+        std::bernoulli_distribution seat(0.75);
+        A a(nrow, ncol);
+        for (int j = 0; j < ncol; ++j) {
+            for (int i = 0; i < nrow; ++i) {
+                a(i, j) = seat(rng) ? 'L' : '.';
+            }
+        }
+        return a;
+    }
+} // namespace seating
+
 int day11(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file and a value for the preamble.\n");
+        fmt::print("Provide an input file, optionally the sizes of the generated grids for the generation and fixpoint benchmarks (0 skips them) and a rule such as adjacent:4 or sight:5.\n");
         return 1;
     }
 
@@ -27,7 +329,7 @@ int day11(int argc, char** argv)
         ncol = line.size();
     }
 
-    using A = Eigen::Array<char, -1, -1>;
+    using A = seating::A;
 
     A a(nrow, ncol);
 
@@ -129,31 +431,165 @@ int day11(int argc, char** argv)
         return occupied;
     };
 
-    int count = -1;
-    int iter = 0;
-
-    A b;
-    while (count != 0) {
-        count = 0;
+    // the reference stepper that walks the rays of every seat, or looks at the adjacent cells, on every generation
+    auto step_rays = [&](A& a, A& b, seating::rule r) {
+        int count = 0;
         b = a;
         for(int i = 0; i < a.rows(); ++i) {
             for (int j = 0; j < a.cols(); ++j) {
                 if (a(i, j) == '.') continue;
-                auto oc = count_occupied_p2(a, i, j);
+                auto oc = r.line_of_sight ? count_occupied_p2(a, i, j) : count_occupied_p1(a, i, j);
                 if (a(i, j) == 'L' && oc == 0) {
                     b(i, j) = '#';
                     ++count;
                 } 
-                if (a(i, j) == '#' && oc >= 5) {
+                if (a(i, j) == '#' && oc >= r.tolerance) {
                     b(i, j) = 'L';
                     ++count;
                 }
             }
         }
-        a = b;
+        return count;
+    };
+
+    auto report = [](seating::simulation const& sim, double seconds) {
+        // the last generation only confirms the fixpoint
+        return fmt::format("{} generations, {} seats evaluated ({:.2f} per seat and generation), {:.1f} us per generation",
+            sim.generation - 1, sim.evaluated, static_cast<double>(sim.evaluated) / std::max<size_t>(1, size_t { sim.g.n } * sim.generation),
+            seconds / sim.generation * 1e6);
+    };
+
+    // a rule given on the command line replaces the two parts of the puzzle
+    std::vector<std::pair<std::string, seating::rule>> rules { { "part 1", seating::part1 }, { "part 2", seating::part2 } };
+    if (argc > 4) {
+        rules = { { argv[4], seating::rule::parse(argv[4]) } };
     }
 
-    fmt::print("part 1: {}\n", (a == '#').count());
+    // the rules are solved concurrently over the same parsed layout, each by the banded stepper on
+    // its share of the cores, and cross-checked with the frontier simulation. not every layout
+    // settles, a run that is still changing after the limit is reported instead of looping forever.
+    uint32_t const run_limit = 10 * static_cast<uint32_t>(std::max(a.rows(), a.cols())) + 100;
+    auto const nthreads = std::max<size_t>(1, chunk_count() / rules.size());
+    std::vector<std::future<std::tuple<bool, size_t, std::string>>> runs;
+    for (auto const& [name, r] : rules) {
+        runs.push_back(std::async(std::launch::async, [&, r = r]() {
+            seating::graph g(a, r.line_of_sight);
+            seating::banded stepper(g, r.tolerance, nthreads);
+            auto t0 = std::chrono::steady_clock::now();
+            auto [state, generations] = stepper.run(g.state(a), run_limit);
+            auto t1 = std::chrono::steady_clock::now();
+            seating::simulation sim(g, g.state(a), r.tolerance);
+            auto settled = sim.run(run_limit);
+            auto t2 = std::chrono::steady_clock::now();
+            if (sim.cur != state || sim.generation != generations) {
+                throw std::runtime_error("the banded stepper and the frontier simulation disagree\n");
+            }
+            auto banded = std::chrono::duration<double>(t1 - t0).count();
+            auto stats = fmt::format("banded on {} threads: {:.1f} us per generation\n  frontier: {}",
+                nthreads, banded / generations * 1e6, report(sim, std::chrono::duration<double>(t2 - t1).count()));
+            return std::make_tuple(settled, std::accumulate(state.begin(), state.end(), size_t { 0 }), stats);
+        }));
+    }
+    for (size_t i = 0; i < rules.size(); ++i) {
+        auto [settled, occupied, stats] = runs[i].get();
+        if (settled) {
+            fmt::print("{}: {}\n", rules[i].first, occupied);
+            fmt::print("  {}\n", stats);
+        } else {
+            fmt::print("{}: no fixpoint within {} generations, {} seats occupied\n", rules[i].first, run_limit, occupied);
+        }
+    }
+
+    // time single generations on a large generated grid, starting from a state two generations in.
+    // the generated grids take a while at useful sizes (2000 and 400), so they only run when asked for.
+    int size = argc > 2 ? parse_number<int>(argv[2]).value() : 0;
+    int fixpoint_size = argc > 3 ? parse_number<int>(argv[3]).value() : size / 5;
+    if (size <= 0 || fixpoint_size <= 0) {
+        return 0;
+    }
+    auto const max_threads = chunk_count();
+
+    ankerl::nanobench::Bench bench;
+    bench.performanceCounters(true).minEpochIterations(1);
+
+    for (auto const& [name, r] : rules) {
+        auto big = seating::generate(size, size, 1234);
+        A tmp;
+        step_rays(big, tmp, r);
+        step_rays(tmp, big, r);
+
+        bench.unit("generation");
+        bench.run(fmt::format("{} rays {}x{}", name, size, size), [&]() { ankerl::nanobench::doNotOptimizeAway(step_rays(big, tmp, r)); });
+
+        seating::graph gb(big, r.line_of_sight);
+        bench.run(fmt::format("{} build neighbour lists {}x{}", name, size, size), [&]() { ankerl::nanobench::doNotOptimizeAway(seating::graph(big, r.line_of_sight)); });
+        auto xb = gb.state(big);
+        auto yb = xb;
+        bench.run(fmt::format("{} neighbour lists {}x{}", name, size, size), [&]() { ankerl::nanobench::doNotOptimizeAway(gb.step(xb.data(), yb.data(), r.tolerance)); });
+
+        // both steppers must agree on the next generation
+        step_rays(big, tmp, r);
+        gb.step(xb.data(), yb.data(), r.tolerance);
+        if (gb.state(tmp) != yb) {
+            throw std::runtime_error("the neighbour lists and the rays disagree\n");
+        }
+
+        // a smaller generated grid to its fixpoint, stepping every seat against stepping the frontier.
+        // the number of generations grows with the size of the grid.
+        auto small = seating::generate(fixpoint_size, fixpoint_size, 1234);
+        seating::graph gs(small, r.line_of_sight);
+        // layouts that oscillate are timed over a fixed number of generations instead
+        uint32_t const limit = 10 * fixpoint_size + 100;
+        auto full = [&]() {
+            auto x = gs.state(small), y = x;
+            uint32_t generations = 0;
+            size_t changed = 0;
+            do {
+                changed = gs.step(x.data(), y.data(), r.tolerance);
+                std::swap(x, y);
+                ++generations;
+            } while (changed != 0 && generations < limit);
+            return std::make_pair(x, generations);
+        };
+        auto frontier = [&]() {
+            seating::simulation s(gs, gs.state(small), r.tolerance);
+            s.run(limit);
+            return s;
+        };
+        auto reference = full();
+        if (reference.second >= limit) {
+            fmt::print("{} {}x{}: no fixpoint within {} generations\n", name, fixpoint_size, fixpoint_size, limit);
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        auto s = frontier();
+        auto t1 = std::chrono::steady_clock::now();
+        fmt::print("{} {}x{}: {}\n", name, fixpoint_size, fixpoint_size, report(s, std::chrono::duration<double>(t1 - t0).count()));
+        if (s.cur != reference.first || s.generation != reference.second) {
+            throw std::runtime_error("the frontier simulation does not reach the same state\n");
+        }
+
+        // the banded stepper from one thread up to all cores
+        double base = 0;
+        for (size_t t = 1;; t = std::min<size_t>(2 * t, max_threads)) {
+            seating::banded stepper(gs, r.tolerance, t);
+            t0 = std::chrono::steady_clock::now();
+            auto result = stepper.run(gs.state(small), limit);
+            t1 = std::chrono::steady_clock::now();
+            if (result != reference) {
+                throw std::runtime_error("the banded stepper does not reach the same state\n");
+            }
+            auto seconds = std::chrono::duration<double>(t1 - t0).count();
+            base = t == 1 ? seconds : base;
+            fmt::print("{} {}x{}: {} threads {:.1f} ms, speedup {:.2f}\n", name, fixpoint_size, fixpoint_size, t, seconds * 1e3, base / seconds);
+            if (t == max_threads) {
+                break;
+            }
+        }
+
+        bench.unit("run");
+        bench.run(fmt::format("{} full steps to fixpoint {}x{}", name, fixpoint_size, fixpoint_size), [&]() { ankerl::nanobench::doNotOptimizeAway(full()); });
+        bench.run(fmt::format("{} frontier to fixpoint {}x{}", name, fixpoint_size, fixpoint_size), [&]() { ankerl::nanobench::doNotOptimizeAway(frontier().occupied()); });
+    }
 
     return 0;
 }
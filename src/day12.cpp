@@ -2,16 +2,131 @@
 
 #include <algorithm>
 #include <bitset>
+#include <chrono>
 #include <functional>
 #include <stack>
 
 #include "advent.hpp"
 #include "util.hpp"
 
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+
+namespace navigation {
+    using M = Eigen::Matrix<int64_t, 2, 2>;
+    using V = Eigen::Matrix<int64_t, 2, 1>;
+
+    // every instruction is an affine map on the ship position p and the direction d, which is the
+    // heading in part 1 and the waypoint in part 2:
+    //   p' = p + A d + b
+    //   d' = R d + c
+    // maps compose into a map of the same form, so a whole log reduces to one of them.
+    struct transform {
+        M A { M::Zero() };
+        M R { M::Identity() };
+        V b { V::Zero() };
+        V c { V::Zero() };
+
+        // f followed by g
+        friend transform then(transform const& f, transform const& g)
+        {
+            transform t;
+            t.A = f.A + g.A * f.R;
+            t.b = f.b + g.A * f.c + g.b;
+            t.R = g.R * f.R;
+            t.c = g.R * f.c + g.c;
+            return t;
+        }
+
+        std::pair<V, V> apply(V const& p, V const& d) const
+        {
+            return { p + A * d + b, R * d + c };
+        }
+    };
+
+    // east is +x and north is +y. with waypoint set the moves act on the direction instead of the ship
+    static transform compile(char dir, int val, bool waypoint)
+    {
+        static M const right = (M() << 0, 1, -1, 0).finished();
+        static M const left = (M() << 0, -1, 1, 0).finished();
+
+        transform t;
+        V move = V::Zero();
+        switch (dir) {
+        case 'N': move = V(0, val); break;
+        case 'S': move = V(0, -val); break;
+        case 'E': move = V(val, 0); break;
+        case 'W': move = V(-val, 0); break;
+        case 'F': t.A = M::Identity() * val; break;
+        case 'R': case 'L':
+            for (int k = 0; k < (val / 90) % 4; ++k) {
+                t.R = (dir == 'R' ? right : left) * t.R;
+            }
+            break;
+        default: break;
+        }
+        (waypoint ? t.c : t.b) = move;
+        return t;
+    }
+
+    // the composition of n instructions given by instruction(i), computed in parallel chunks whose
+    // results are folded in order since composition is associative but not commutative
+    template <typename F>
+    static transform reduce(size_t n, F&& instruction, size_t nchunks = 0)
+    {
+        auto parts = parallel_chunks(n, [&](size_t begin, size_t end) {
+            transform t;
+            for (size_t i = begin; i < end; ++i) {
+                t = then(t, instruction(i));
+            }
+            return t;
+        }, nchunks);
+        return std::accumulate(parts.begin(), parts.end(), transform {}, [](auto const& f, auto const& g) { return then(f, g); });
+    }
+
+    // a segment tree of composed transforms, the map after the first k instructions is the
+    // composition of O(log n) nodes
+    struct transform_tree {
+        explicit transform_tree(std::vector<transform> const& leaves)
+        {
+            size = 1;
+            while (size < leaves.size()) size *= 2;
+            nodes.resize(2 * size);
+            std::copy(leaves.begin(), leaves.end(), nodes.begin() + size);
+            for (auto i = size - 1; i > 0; --i) {
+                nodes[i] = then(nodes[2 * i], nodes[2 * i + 1]);
+            }
+        }
+
+        transform prefix(size_t k) const
+        {
+            transform t;
+            size_t node = 1, width = size;
+            while (k > 0) {
+                if (k >= width) {
+                    return then(t, nodes[node]);
+                }
+                width /= 2;
+                if (k >= width) {
+                    t = then(t, nodes[2 * node]);
+                    k -= width;
+                    node = 2 * node + 1;
+                } else {
+                    node = 2 * node;
+                }
+            }
+            return t;
+        }
+
+        size_t size;
+        std::vector<transform> nodes;
+    };
+} // namespace navigation
+
 int day12(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file and a value for the preamble.\n");
+        fmt::print("Provide an input file, optionally a generated log length (0 skips it, the default) and a list of steps k,... to query the position after.\n");
         return 1;
     }
 
@@ -76,52 +191,119 @@ int day12(int argc, char** argv)
     std::cout << "ship: " << as_map(ship).transpose() << "\n";
     fmt::print("part 1: {}\n", std::abs(ship[1] - ship[3]) + std::abs(ship[0] - ship[2]));
 
-    // part 2
-    std::array<int, 4> waypoint { 10, 0, 0, 1 };
-    ship = { 0, 0, 0, 0 }; // reset ship position
-    i = 0; // reset orientation to facing east
-    
-    for (auto [dir, val] : input) {
-        switch (dir) {
-        case 'R': {
-            // rotate the waypoint around the ship clockwise
-            std::rotate(waypoint.rbegin(), waypoint.rbegin() + val / 90, waypoint.rend());
-            break;
-        }
-        case 'L': {
-            // rotate the waypoint around the ship counter-clockwise
-            std::rotate(waypoint.begin(), waypoint.begin() + val / 90, waypoint.end());
-            break;
-        }
-        case 'F': {
-            for (int j = 0; j < 4; ++j)
-                ship[j] += val * waypoint[j];
-            break;
-        }
-        case 'N': {
-            waypoint[3] += val;
-            break;
-        }
-        case 'S': {
-            waypoint[1] += val;
-            break;
-        }
-        case 'E': {
-            waypoint[0] += val;
-            break;
-        }
-        case 'W': {
-            waypoint[2] += val;
-            break;
+    // part 2, the same loop is timed below against the composed transforms
+    auto part2 = [&]() {
+        std::array<int, 4> waypoint { 10, 0, 0, 1 };
+        std::array<int, 4> ship { 0, 0, 0, 0 };
+        for (auto [dir, val] : input) {
+            switch (dir) {
+            case 'R': {
+                // rotate the waypoint around the ship clockwise
+                std::rotate(waypoint.rbegin(), waypoint.rbegin() + val / 90, waypoint.rend());
+                break;
+            }
+            case 'L': {
+                // rotate the waypoint around the ship counter-clockwise
+                std::rotate(waypoint.begin(), waypoint.begin() + val / 90, waypoint.end());
+                break;
+            }
+            case 'F': {
+                for (int j = 0; j < 4; ++j)
+                    ship[j] += val * waypoint[j];
+                break;
+            }
+            case 'N': {
+                waypoint[3] += val;
+                break;
+            }
+            case 'S': {
+                waypoint[1] += val;
+                break;
+            }
+            case 'E': {
+                waypoint[0] += val;
+                break;
+            }
+            case 'W': {
+                waypoint[2] += val;
+                break;
+            }
+            default: {
+                break;
+            }
+            }
         }
-        default: {
-            break;
+        return ship;
+    };
+
+    ship = part2();
+    std::cout << "ship: " << as_map(ship).transpose() << "\n";
+    fmt::print("part 2: {}\n", std::abs(ship[1] - ship[3]) + std::abs(ship[0] - ship[2]));
+
+    // the same through the composed transforms
+    using navigation::V;
+    V const heading(1, 0), waypoint0(10, 1);
+    auto start = [&](bool wp) { return wp ? waypoint0 : heading; };
+    std::array<std::vector<navigation::transform>, 2> compiled;
+    for (bool wp : { false, true }) {
+        for (auto [dir, val] : input) {
+            compiled[wp].push_back(navigation::compile(dir, val, wp));
         }
+        auto t = navigation::reduce(input.size(), [&](size_t i) { return compiled[wp][i]; });
+        auto [p, d] = t.apply(V::Zero(), start(wp));
+        fmt::print("part {} (transforms): {}\n", 1 + wp, std::abs(p.x()) + std::abs(p.y()));
+    }
+
+    // positions after step k from the segment trees, checked against stepping through the instructions
+    std::array<navigation::transform_tree, 2> trees { navigation::transform_tree(compiled[0]), navigation::transform_tree(compiled[1]) };
+    if (argc > 3) {
+        for (auto const& token : split(argv[3], ',')) {
+            auto k = std::min(parse_number<size_t>(token).value(), input.size());
+            for (bool wp : { false, true }) {
+                auto [p, d] = trees[wp].prefix(k).apply(V::Zero(), start(wp));
+                V q = V::Zero(), e = start(wp);
+                for (size_t i = 0; i < k; ++i) {
+                    std::tie(q, e) = compiled[wp][i].apply(q, e);
+                }
+                if (p != q || d != e) {
+                    throw std::runtime_error(fmt::format("the segment tree disagrees at step {}\n", k));
+                }
+                fmt::print("part {} after step {}: ship at ({}, {}), {} ({}, {})\n", 1 + wp, k, p.x(), p.y(), wp ? "waypoint" : "heading", d.x(), d.y());
+            }
         }
     }
 
-    std::cout << "ship: " << as_map(ship).transpose() << "\n";
-    fmt::print("part 2: {}\n", std::abs(ship[1] - ship[3]) + std::abs(ship[0] - ship[2]));
+    // a generated log, instructions are made up from their index so the log need not fit in memory.
+    // a useful length is around 10^7 instructions, so the log is only generated when asked for.
+    size_t length = argc > 2 ? parse_number<size_t>(argv[2]).value() : 0;
+    if (length > 0) {
+        auto generated = [](size_t i) {
+            auto h = XXH3_64bits(&i, sizeof(i));
+            constexpr std::array<char, 7> dirs { 'N', 'S', 'E', 'W', 'L', 'R', 'F' };
+            auto dir = dirs[h % dirs.size()];
+            int val = dir == 'L' || dir == 'R' ? 90 * (1 + (h >> 8) % 3) : 1 + (h >> 8) % 9;
+            return navigation::compile(dir, val, true);
+        };
+
+        auto t0 = std::chrono::steady_clock::now();
+        auto t = navigation::reduce(length, generated);
+        auto t1 = std::chrono::steady_clock::now();
+        auto [p, d] = t.apply(V::Zero(), waypoint0);
+        auto seconds = std::chrono::duration<double>(t1 - t0).count();
+        fmt::print("generated log of {} instructions: ship at ({}, {}), {:.1f} M instructions/s\n", length, p.x(), p.y(), length / seconds / 1e6);
+    }
+
+    ankerl::nanobench::Bench bench;
+    bench.performanceCounters(true).minEpochIterations(100);
+    bench.run("part 2 switch", [&]() { ankerl::nanobench::doNotOptimizeAway(part2()); });
+    bench.run("part 2 transforms", [&]() { ankerl::nanobench::doNotOptimizeAway(navigation::reduce(input.size(), [&](size_t i) { return compiled[1][i]; })); });
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> step(0, input.size());
+    bench.batch(1000).unit("query").run("position after step k", [&]() {
+        for (int i = 0; i < 1000; ++i) {
+            ankerl::nanobench::doNotOptimizeAway(trees[1].prefix(step(rng)));
+        }
+    });
 
     return 0;
 }
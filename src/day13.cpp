@@ -1,17 +1,200 @@
 #include <fmt/format.h>
 
 #include <algorithm>
+#include <array>
 #include <bitset>
+#include <chrono>
 #include <functional>
+#include <limits>
+#include <stdexcept>
 #include <stack>
 
 #include "advent.hpp"
 #include "util.hpp"
+#include "robin_hood.h"
+
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+
+namespace schedule {
+    using u128 = unsigned __int128;
+    using i128 = __int128;
+
+    // x = r (mod m) with 0 <= r < m. moduli stay below 2^127 so that they also fit in an i128.
+    struct congruence {
+        u128 r;
+        u128 m;
+    };
+
+    static constexpr u128 max_modulus = u128 { 1 } << 127;
+
+    // returns g = gcd(a, b) and x with a x = g (mod b)
+    static std::pair<u128, i128> ext_gcd(u128 a, u128 b)
+    {
+        i128 x0 = 1, x1 = 0;
+        i128 r0 = a, r1 = b;
+        while (r1 != 0) {
+            auto q = r0 / r1;
+            std::tie(r0, r1) = std::make_pair(r1, r0 - q * r1);
+            std::tie(x0, x1) = std::make_pair(x1, x0 - q * x1);
+        }
+        return { static_cast<u128>(r0), x0 };
+    }
+
+    static u128 add_mod(u128 a, u128 b, u128 m)
+    {
+        return a >= m - b ? a - (m - b) : a + b;
+    }
+
+    // products of operands below 2^64 fit, larger ones fall back to double-and-add
+    static u128 mul_mod(u128 a, u128 b, u128 m)
+    {
+        a %= m;
+        b %= m;
+        if ((a >> 64) == 0 && (b >> 64) == 0) {
+            return a * b % m;
+        }
+        u128 r = 0;
+        for (; b != 0; b >>= 1) {
+            if (b & 1) r = add_mod(r, a, m);
+            a = add_mod(a, a, m);
+        }
+        return r;
+    }
+
+    // the combined congruence, or nothing if the two are inconsistent. the moduli need not be
+    // coprime: a solution exists iff r1 = r2 (mod gcd(m1, m2)) and the result is modulo the lcm.
+    static std::optional<congruence> merge(congruence a, congruence b)
+    {
+        auto [g, x] = ext_gcd(a.m, b.m);
+        auto diff = add_mod(b.r % b.m, b.m - a.r % b.m, b.m);
+        if (diff % g != 0) {
+            return std::nullopt;
+        }
+        auto mg = b.m / g;
+        u128 lcm;
+        if (__builtin_mul_overflow(a.m, mg, &lcm) || lcm >= max_modulus) {
+            throw std::overflow_error("the combined period does not fit in 127 bits\n");
+        }
+        // a.m / g is invertible modulo mg with inverse x
+        u128 inv = static_cast<u128>((x % static_cast<i128>(mg) + static_cast<i128>(mg)) % static_cast<i128>(mg));
+        auto k = mul_mod(diff / g, inv, mg);
+        return congruence { (a.r + a.m * k) % lcm, lcm };
+    }
+
+    // merges pairs of neighbours level by level, so the operands of every merge have similar sizes
+    static std::optional<congruence> solve(std::vector<congruence> cs)
+    {
+        if (cs.empty()) {
+            return congruence { 0, 1 };
+        }
+        while (cs.size() > 1) {
+            size_t j = 0;
+            for (size_t i = 0; i + 1 < cs.size(); i += 2) {
+                auto c = merge(cs[i], cs[i + 1]);
+                if (!c.has_value()) {
+                    return std::nullopt;
+                }
+                cs[j++] = c.value();
+            }
+            if (cs.size() % 2 == 1) {
+                cs[j++] = cs.back();
+            }
+            cs.resize(j);
+        }
+        return cs.front();
+    }
+
+    // a modulo by a fixed divisor with a precomputed reciprocal m = floor((2^64 - 1) / d): the
+    // quotient estimate from the high half of a m is at most two too small, so the remainder
+    // needs at most two corrections and no division
+    struct divider {
+        explicit divider(uint64_t d) : d(d), m(~uint64_t { 0 } / d) { }
+
+        uint64_t mod(uint64_t a) const
+        {
+            auto q = static_cast<uint64_t>((static_cast<u128>(a) * m) >> 64);
+            auto r = a - q * d;
+            r -= r >= d ? d : 0;
+            r -= r >= d ? d : 0;
+            return r;
+        }
+
+        uint64_t d;
+        uint64_t m;
+    };
+
+    // the bus list prepared for many queries: earliest bus after a batch of timestamps, and the
+    // first aligned departure of a subset of the buses given as a bit mask
+    struct timetable {
+        explicit timetable(std::vector<std::pair<uint64_t, uint64_t>> const& buses)
+        {
+            for (auto [interval, offset] : buses) {
+                ids.push_back(interval);
+                dividers.emplace_back(interval);
+                constraints.push_back({ (interval - offset % interval) % interval, interval });
+            }
+        }
+
+        // the shortest wait and the bus to take, the first bus wins ties
+        std::pair<uint64_t, uint64_t> earliest(uint64_t s) const
+        {
+            uint64_t best = std::numeric_limits<uint64_t>::max(), id = 0;
+            for (size_t i = 0; i < ids.size(); ++i) {
+                auto r = dividers[i].mod(s);
+                auto wait = r == 0 ? 0 : ids[i] - r;
+                id = wait < best ? ids[i] : id;
+                best = std::min(best, wait);
+            }
+            return { best, id };
+        }
+
+        void earliest(gsl::span<uint64_t const> s, gsl::span<std::pair<uint64_t, uint64_t>> out) const
+        {
+            for (size_t i = 0; i < s.size(); ++i) {
+                out[i] = earliest(s[i]);
+            }
+        }
+
+        // the subset is split into two halves with the same number of buses, and the merges of
+        // both halves are cached, so overlapping subsets reuse each other's partial results
+        std::optional<congruence> align(uint64_t mask)
+        {
+            if (ids.size() < 64 && (mask >> ids.size()) != 0) {
+                throw std::runtime_error(fmt::format("the subset {:#x} contains unknown buses\n", mask));
+            }
+            if (mask == 0) {
+                return congruence { 0, 1 };
+            }
+            if ((mask & (mask - 1)) == 0) {
+                return constraints[__builtin_ctzll(mask)];
+            }
+            if (auto it = cache.find(mask); it != cache.end()) {
+                return it->second;
+            }
+            auto low = mask;
+            for (int k = __builtin_popcountll(mask) / 2; k > 0; --k) {
+                low &= low - 1;
+            }
+            low = mask ^ low;
+            auto a = align(low);
+            auto b = a.has_value() ? align(mask ^ low) : std::nullopt;
+            auto c = a.has_value() && b.has_value() ? merge(a.value(), b.value()) : std::nullopt;
+            cache.emplace(mask, c);
+            return c;
+        }
+
+        std::vector<uint64_t> ids;
+        std::vector<divider> dividers;
+        std::vector<congruence> constraints;
+        robin_hood::unordered_map<uint64_t, std::optional<congruence>> cache;
+    };
+} // namespace schedule
 
 int day13(int argc, char** argv)
 {
     if (argc < 2) {
-        fmt::print("Provide an input file.\n");
+        fmt::print("Provide an input file and optionally the number of generated constraints and of batch queries (0 skips them, the default).\n");
         return 1;
     }
 
@@ -33,29 +216,139 @@ int day13(int argc, char** argv)
         ++i;
     }
 
-    uint64_t ans = std::numeric_limits<uint64_t>::max();
-    uint64_t id;
-    for (auto [time, period] : buses) {
-        auto wait = time - s % time;
-        if (ans > wait) {
-            ans = wait;
-            id = time;
+    schedule::timetable table(buses);
+    auto [ans, id] = table.earliest(s);
+    fmt::print("part 1: {}\n", ans * id);
+
+    // part 2, the departure t satisfies t + offset = 0 (mod period) for every bus
+    auto part2 = schedule::solve(table.constraints);
+    if (part2.has_value()) {
+        fmt::print("part 2: {}\n", part2->r);
+    } else {
+        fmt::print("part 2 no solution\n");
+    }
+
+    // the sieve that steps through the multiples of the combined period, kept as the reference
+    auto sieve = [&]() {
+        uint64_t a{0}, b{1};
+        for (auto [interval, offset] : buses) {
+            for (size_t k = 0; k < interval; ++k) {
+                auto c = a + k * b;
+                if ((c + offset) % interval == 0) {
+                    a = c;
+                    b = std::lcm(b, interval);
+                    break;
+                }
+            }
         }
+        return a;
+    };
+    if (part2.has_value() && part2->r != sieve()) {
+        throw std::runtime_error("the sieve and the crt solver disagree\n");
     }
-    fmt::print("part 1: {}\n", ans * id);
 
-    // part 2
-    uint64_t a{0}, b{1};
-    for (auto [interval, offset] : buses) {
-        for (size_t k = 0; k < interval; ++k) {
-            auto c = a + k * b;
-            if ((c + offset) % interval == 0) {
-                a = c;
-                b = std::lcm(b, interval);
-                break;
+    // generated constraints with large periods that share factors. every period divides the product
+    // of the first 25 primes, which keeps the combined period below 2^127.
+    size_t n = argc > 2 ? parse_number<size_t>(argv[2]).value() : 2000;
+    constexpr std::array<uint64_t, 25> primes { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97 };
+    std::mt19937_64 rng(1234);
+    schedule::u128 secret = (schedule::u128 { rng() } << 64 | rng()) >> 9;
+    std::vector<schedule::congruence> generated;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t period = 1;
+        for (auto p : primes) {
+            if (rng() % 3 == 0 && period <= std::numeric_limits<uint64_t>::max() / p) {
+                period *= p;
             }
         }
+        generated.push_back({ secret % period, period });
+    }
+    auto solution = schedule::solve(generated);
+    if (!solution.has_value() || std::any_of(generated.begin(), generated.end(), [&](auto c) { return solution->r % c.m != c.r; })) {
+        throw std::runtime_error("no consistent solution for the generated constraints\n");
     }
-    fmt::print("part 2: {}\n", a);
+    fmt::print("generated: {} constraints, t = {} (mod {})\n", n, solution->r, solution->m);
+
+    // the same constraints with one residue moved must be rejected
+    auto broken = generated;
+    broken.back().r = (broken.back().r + 1) % broken.back().m;
+    if (broken.back().m > 1 && schedule::solve(broken).has_value()) {
+        throw std::runtime_error("inconsistent constraints were not detected\n");
+    }
+
+    // batches of random timestamps and bus subsets, checked against plain division and fresh merges.
+    // a useful batch is around 10^6 queries, so the batches only run when asked for.
+    size_t nqueries = argc > 3 ? parse_number<size_t>(argv[3]).value() : 0;
+    if (nqueries > 0) {
+        std::vector<uint64_t> timestamps(nqueries);
+        std::uniform_int_distribution<uint64_t> timestamp(0, uint64_t { 1 } << 48);
+        std::generate(timestamps.begin(), timestamps.end(), [&]() { return timestamp(rng); });
+        std::vector<std::pair<uint64_t, uint64_t>> departures(nqueries);
+        table.earliest(timestamps, departures);
+        for (size_t k = 0; k < std::min<size_t>(nqueries, 10'000); ++k) {
+            uint64_t best = std::numeric_limits<uint64_t>::max(), bus = 0;
+            for (auto id : table.ids) {
+                auto wait = (id - timestamps[k] % id) % id;
+                if (wait < best) {
+                    best = wait;
+                    bus = id;
+                }
+            }
+            if (departures[k] != std::make_pair(best, bus)) {
+                throw std::runtime_error(fmt::format("wrong earliest bus for timestamp {}\n", timestamps[k]));
+            }
+        }
+
+        auto nbuses = std::min<size_t>(table.ids.size(), 64);
+        auto all = nbuses == 64 ? ~uint64_t { 0 } : (uint64_t { 1 } << nbuses) - 1;
+        std::vector<uint64_t> subsets(nqueries);
+        std::generate(subsets.begin(), subsets.end(), [&]() { return rng() & all; });
+        for (size_t k = 0; k < std::min<size_t>(nqueries, 1000); ++k) {
+            std::vector<schedule::congruence> subset;
+            for (size_t b = 0; b < nbuses; ++b) {
+                if ((subsets[k] >> b) & 1) subset.push_back(table.constraints[b]);
+            }
+            auto expected = schedule::solve(subset), actual = table.align(subsets[k]);
+            if (expected.has_value() != actual.has_value() || (expected.has_value() && (expected->r != actual->r || expected->m != actual->m))) {
+                throw std::runtime_error(fmt::format("wrong alignment for the subset {:#x}\n", subsets[k]));
+            }
+        }
+
+        auto throughput = [&](std::string const& name, auto&& f) {
+            auto t0 = std::chrono::steady_clock::now();
+            f();
+            auto t1 = std::chrono::steady_clock::now();
+            fmt::print("{}: {:.1f} M queries/s\n", name, nqueries / std::chrono::duration<double>(t1 - t0).count() / 1e6);
+        };
+        throughput("earliest bus, reciprocals", [&]() { table.earliest(timestamps, departures); });
+        throughput("earliest bus, division", [&]() {
+            for (size_t k = 0; k < nqueries; ++k) {
+                uint64_t best = std::numeric_limits<uint64_t>::max();
+                for (auto id : table.ids) {
+                    best = std::min(best, (id - timestamps[k] % id) % id);
+                }
+                departures[k].first = best;
+            }
+            ankerl::nanobench::doNotOptimizeAway(departures);
+        });
+        // the checks above have already filled part of the cache, so the first run starts from an
+        // empty one and the second reuses everything the first one merged
+        auto align_all = [&]() {
+            for (auto m : subsets) {
+                ankerl::nanobench::doNotOptimizeAway(table.align(m));
+            }
+        };
+        table.cache.clear();
+        throughput("aligned subsets, cold cache", align_all);
+        throughput("aligned subsets, warm cache", align_all);
+        fmt::print("{} cached partial merges\n", table.cache.size());
+    }
+
+    ankerl::nanobench::Bench bench;
+    bench.performanceCounters(true).minEpochIterations(100);
+    bench.run("part 2 sieve", [&]() { ankerl::nanobench::doNotOptimizeAway(sieve()); });
+    bench.run("part 2 crt", [&]() { ankerl::nanobench::doNotOptimizeAway(schedule::solve(table.constraints)); });
+    bench.run(fmt::format("generated {} crt", n), [&]() { ankerl::nanobench::doNotOptimizeAway(schedule::solve(generated)); });
+
     return 0;
 }
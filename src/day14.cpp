@@ -9,97 +9,238 @@
 #include "advent.hpp"
 #include "util.hpp"
 
-int day14(int argc, char** argv)
-{
-    if (argc < 2) {
-        fmt::print("Provide an input file.\n");
-        return 1;
-    }
-
-    std::ifstream in(argv[1]);
-    std::string line;
+#define ANKERL_NANOBENCH_IMPLEMENT
+#include "nanobench.h"
+
+namespace docking {
+    // a mask as three words over the 36 address bits: and_mask keeps the bits under X and 1,
+    // or_mask sets the bits under 1 and float_mask marks the bits under X
+    struct mask {
+        uint64_t and_mask;
+        uint64_t or_mask;
+        uint64_t float_mask;
+    };
 
-    robin_hood::unordered_map<uint64_t, uint64_t> mem;
-    std::string mask;
+    struct write {
+        uint64_t addr;
+        uint64_t value;
+        uint32_t mask; // index into program::masks
+    };
 
-    std::vector<std::string> input;
+    struct program {
+        std::vector<mask> masks;
+        std::vector<write> writes;
+    };
 
-    while(std::getline(in, line)) {
-        if(line.empty()) continue;
-        input.push_back(line);
+    static program parse(std::istream& in)
+    {
+        program prog;
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string_view sv(line);
+            if (sv.empty()) {
+                continue;
+            }
+            auto eq = sv.find(" = ");
+            if (eq == std::string_view::npos) {
+                throw std::runtime_error(fmt::format("cannot parse {}\n", line));
+            }
+            auto rhs = sv.substr(eq + 3);
+            if (sv.substr(0, eq) == "mask") {
+                if (rhs.size() != 36) {
+                    throw std::runtime_error(fmt::format("mask {} does not have 36 bits\n", rhs));
+                }
+                mask m { 0, 0, 0 };
+                for (auto c : rhs) {
+                    m.and_mask = (m.and_mask << 1) | (c != '0');
+                    m.or_mask = (m.or_mask << 1) | (c == '1');
+                    m.float_mask = (m.float_mask << 1) | (c == 'X');
+                }
+                prog.masks.push_back(m);
+            } else if (sv.substr(0, 4) == "mem[" && eq > 5 && prog.masks.size() > 0) {
+                auto addr = parse_number<uint64_t>(sv.substr(4, eq - 5));
+                auto value = parse_number<uint64_t>(rhs);
+                if (!addr.has_value() || !value.has_value()) {
+                    throw std::runtime_error(fmt::format("cannot parse {}\n", line));
+                }
+                prog.writes.push_back({ addr.value(), value.value(), static_cast<uint32_t>(prog.masks.size() - 1) });
+            } else {
+                throw std::runtime_error(fmt::format("cannot parse {}\n", line));
+            }
+        }
+        return prog;
     }
 
-    // part 1
-    for (auto const& line : input) {
-        auto tokens = split(line, ' ');
-
-        if (tokens[0] == "mask") {
-            mask = tokens[2];
-        } else {
-            // parse memory address
-            auto addr = parse_number<uint64_t>(std::string_view(tokens[0].data() + 4, tokens[0].size() - 5)).value();
-
-            // parse value and apply mask
-            auto val = parse_number<uint64_t>(tokens[2]).value();
-            auto bits = std::bitset<36>(val);
-            for(size_t i = 0, j = 35; i < bits.size(); ++i, --j) {
-                if (mask[j] == '0') bits[i] = false;
-                else if (mask[j] == '1') bits[i] = true;
+    // open addressing with linear probing, the capacity is fixed up front from the number of
+    // writes. addresses have 36 bits so an all-ones key marks an empty slot.
+    struct memory {
+        static constexpr uint64_t empty = ~uint64_t { 0 };
+
+        explicit memory(size_t writes)
+        {
+            size_t capacity = 16;
+            while (capacity < 2 * writes) capacity *= 2;
+            shift = 64 - __builtin_ctzll(capacity);
+            keys.assign(capacity, empty);
+            values.assign(capacity, 0);
+        }
+
+        void store(uint64_t addr, uint64_t value)
+        {
+            auto i = (addr * 0x9e3779b97f4a7c15) >> shift;
+            while (keys[i] != empty && keys[i] != addr) {
+                i = (i + 1) & (keys.size() - 1);
             }
-            mem[addr] = bits.to_ulong();
+            keys[i] = addr;
+            values[i] = value;
         }
-    }
 
-    auto sum = std::transform_reduce(mem.begin(), mem.end(), 0ul, std::plus{}, [](auto p) { return p.second; }); 
-    fmt::print("part 1: {}\n", sum);
+        uint64_t sum() const
+        {
+            return std::accumulate(values.begin(), values.end(), uint64_t { 0 });
+        }
+
+        int shift;
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> values;
+    };
 
+    // a set of addresses with the bits under floating free and all other bits as in fixed
+    struct cube {
+        uint64_t fixed; // the floating bits are clear
+        uint64_t floating;
 
-    // part 2
-    std::bitset<36> bits;
-    std::vector<int> floating;
-    mem.clear();
+        uint64_t size() const { return uint64_t { 1 } << __builtin_popcountll(floating); }
+    };
+
+    static bool intersects(cube a, cube b)
+    {
+        return ((a.fixed ^ b.fixed) & ~a.floating & ~b.floating) == 0;
+    }
 
-    // helper function to handle the floating bits
-    auto helper = [&](size_t v, size_t i, auto &&rec) {
-        if (i == floating.size()) {
-            mem[bits.to_ulong()] = v;
+    // appends r minus d as disjoint cubes: every bit that floats in r but is fixed in d splits off
+    // the half of r on the other side of d, and the rest of r continues with that bit fixed
+    static void subtract(cube r, cube d, std::vector<cube>& out)
+    {
+        if (!intersects(r, d)) {
+            out.push_back(r);
             return;
         }
-        auto j = floating[i];
-        for (auto b : { true, false }) {
-            bits[j] = b;
-            rec(v, i+1, rec);
+        for (auto bits = r.floating & ~d.floating; bits != 0; bits &= bits - 1) {
+            auto b = bits & -bits;
+            r.floating &= ~b;
+            out.push_back({ r.fixed | (~d.fixed & b), r.floating });
+            r.fixed |= d.fixed & b;
         }
-    };
+        // what is left of r lies inside d
+    }
 
-    for (auto const& line : input) {
-        auto tokens = split(line, ' ');
+    // part 2 without enumerating addresses. a write only counts for the addresses that no later
+    // write overwrites, so the writes are processed newest first and each one's cube is reduced
+    // by the cubes of the later writes. the work depends on the number of writes and how their
+    // cubes overlap, not on the number of addresses they cover.
+    static uint64_t floating_sum(program const& prog)
+    {
+        std::vector<cube> later, pieces, next;
+        uint64_t sum = 0;
+        for (auto it = prog.writes.rbegin(); it != prog.writes.rend(); ++it) {
+            auto const& m = prog.masks[it->mask];
+            cube c { (it->addr | m.or_mask) & ~m.float_mask, m.float_mask };
+            pieces.assign(1, c);
+            for (auto const& d : later) {
+                next.clear();
+                for (auto const& r : pieces) {
+                    subtract(r, d, next);
+                }
+                std::swap(pieces, next);
+                if (pieces.empty()) {
+                    break;
+                }
+            }
+            uint64_t count = 0;
+            for (auto const& r : pieces) {
+                count += r.size();
+            }
+            sum += count * it->value;
+            // a write that is completely overwritten does not hide anything from older writes
+            if (!pieces.empty()) {
+                later.push_back(c);
+            }
+        }
+        return sum;
+    }
+} // namespace docking
 
-        if (tokens[0] == "mask") {
-            mask = tokens[2];
-        } else {
-            // parse memory address
-            auto addr = parse_number<uint64_t>(std::string_view(tokens[0].data() + 4, tokens[0].size() - 5)).value();
+int day14(int argc, char** argv)
+{
+    if (argc < 2) {
+        fmt::print("Provide an input file.\n");
+        return 1;
+    }
+
+    std::ifstream in(argv[1]);
+    auto prog = docking::parse(in);
+
+    // part 1, the masks apply to the values
+    docking::memory memory(prog.writes.size());
+    for (auto const& w : prog.writes) {
+        auto const& m = prog.masks[w.mask];
+        memory.store(w.addr, (w.value & m.and_mask) | m.or_mask);
+    }
+    fmt::print("part 1: {}\n", memory.sum());
+
+    // part 2, the masks apply to the addresses
+    fmt::print("part 2: {}\n", docking::floating_sum(prog));
+
+    // the enumeration of every floating address, kept as the reference when the number of addresses is small
+    auto enumerate = [&]() {
+        robin_hood::unordered_map<uint64_t, uint64_t> mem;
+        std::bitset<36> bits;
+        std::vector<int> floating;
+
+        // helper function to handle the floating bits
+        auto helper = [&](size_t v, size_t i, auto &&rec) {
+            if (i == floating.size()) {
+                mem[bits.to_ulong()] = v;
+                return;
+            }
+            auto j = floating[i];
+            for (auto b : { true, false }) {
+                bits[j] = b;
+                rec(v, i+1, rec);
+            }
+        };
 
-            // parse value and apply mask
-            auto val = parse_number<uint64_t>(tokens[2]).value();
-            bits = std::bitset<36>(addr);
+        for (auto const& w : prog.writes) {
+            auto const& m = prog.masks[w.mask];
+            bits = std::bitset<36>(w.addr | m.or_mask);
             floating.clear();
-            for(size_t i = 0, j = 35; i < bits.size(); ++i, --j) {
-                if (mask[j] == '0') { 
-                    // unchanged
-                } else if (mask[j] == '1') {
-                    bits[i] = true;
-                } else if (mask[j] == 'X') {
+            for (int i = 0; i < 36; ++i) {
+                if ((m.float_mask >> i) & 1) {
                     floating.push_back(i);
                 }
             }
-            helper(val, 0, helper);
+            helper(w.value, 0, helper);
         }
-    }
 
-    sum = std::transform_reduce(mem.begin(), mem.end(), 0ul, std::plus{}, [](auto p) { return p.second; }); 
-    fmt::print("part 2: {}\n", sum);
+        return std::transform_reduce(mem.begin(), mem.end(), 0ul, std::plus{}, [](auto p) { return p.second; });
+    };
+
+    double addresses = 0;
+    for (auto const& w : prog.writes) {
+        addresses += std::ldexp(1.0, __builtin_popcountll(prog.masks[w.mask].float_mask));
+    }
+    ankerl::nanobench::Bench bench;
+    bench.performanceCounters(true).minEpochIterations(10);
+    bench.run("part 2 cubes", [&]() { ankerl::nanobench::doNotOptimizeAway(docking::floating_sum(prog)); });
+    if (addresses <= (1 << 24)) {
+        if (enumerate() != docking::floating_sum(prog)) {
+            throw std::runtime_error("the cubes and the enumeration disagree\n");
+        }
+        bench.run("part 2 enumeration", [&]() { ankerl::nanobench::doNotOptimizeAway(enumerate()); });
+    } else {
+        fmt::print("{:.3g} floating addresses, skipping the enumeration\n", addresses);
+    }
 
     return 0;
 }
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <charconv>
 #include <cmath>
+#include <execution>
 #include <fstream>
 #include <iostream>
 #include <numeric>
@@ -17,6 +18,7 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -68,6 +70,30 @@ static std::optional<T> parse_number(char const* p)
     return parse_number<T>(std::string_view(p));
 }
 
+// the number of chunks for the parallel loops, one per hardware thread unless requested otherwise
+static size_t chunk_count(size_t requested = 0)
+{
+    return requested > 0 ? requested : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// splits [0, n) into at most nchunks contiguous non-empty chunks, calls f(begin, end) for every
+// chunk on the parallel policy and returns the results in chunk order, so that callers can fold
+// them with an operation that is associative but not commutative
+template <typename F>
+static auto parallel_chunks(size_t n, F&& f, size_t nchunks = 0)
+{
+    using result = std::decay_t<std::invoke_result_t<F&, size_t, size_t>>;
+    auto const k = chunk_count(nchunks);
+    auto const chunk_size = std::max<size_t>(1, (n + k - 1) / k);
+    std::vector<size_t> chunks((n + chunk_size - 1) / chunk_size);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    std::vector<result> results(chunks.size());
+    std::for_each(std::execution::par, chunks.begin(), chunks.end(), [&](size_t c) {
+        results[c] = f(c * chunk_size, std::min(n, (c + 1) * chunk_size));
+    });
+    return results;
+}
+
 static std::vector<std::string> split(const std::string& s, char delimiter)
 {
     std::vector<std::string> tokens;